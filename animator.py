@@ -59,17 +59,19 @@ def update(frame_idx, frames, scatter, rect, ax, title, global_max_mass):
         
         scatter.set_sizes(final_sizes)
         
-        # Red Box
-        max_coord = np.max(np.abs(data[:, :2]))
-        half_dim = max_coord * 1.5 + 10.0
+        # Red Box (tight AABB, as in Simulation::updateBounds)
+        lo = np.min(data[:, :2], axis=0)
+        hi = np.max(data[:, :2], axis=0)
+        center = (lo + hi) / 2
+        half_dim = max(np.max(hi - lo) / 2, 1.0)
         
-        rect.set_xy((-half_dim, -half_dim))
+        rect.set_xy((center[0] - half_dim, center[1] - half_dim))
         rect.set_width(half_dim * 2)
         rect.set_height(half_dim * 2)
         
         view_limit = half_dim * PADDING
-        ax.set_xlim(-view_limit, view_limit)
-        ax.set_ylim(-view_limit, view_limit)
+        ax.set_xlim(center[0] - view_limit, center[0] + view_limit)
+        ax.set_ylim(center[1] - view_limit, center[1] + view_limit)
 
     title.set_text(f"Step: {frame_idx}")
     return scatter, rect, title
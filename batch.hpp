@@ -0,0 +1,111 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include "simulation.hpp"
+
+using namespace std;
+
+// One entry of a parameter sweep.
+struct SimConfig {
+    string inputFile;
+    string outputFile;
+    double k = G_CONST;
+    double power = 2.0;
+    double timeStep = 0.01;
+    int steps = 100;
+    double theta = ds::THETA_DEFAULT;
+    double periodicBox = 0; // 0 = open boundaries
+};
+
+struct BatchResult {
+    size_t completed = 0;
+    size_t failed = 0;
+    long long totalSteps = 0;
+    long long particleSteps = 0;
+    double seconds = 0;
+
+    double stepsPerSecond() const { return seconds > 0 ? totalSteps / seconds : 0; }
+    double particleStepsPerSecond() const { return seconds > 0 ? particleSteps / seconds : 0; }
+};
+
+// Batch file: one simulation per line,
+//   input, output, k, power, dt, steps[, theta[, periodic box side]]
+// blank lines and lines starting with '#' are skipped.
+inline vector<SimConfig> loadBatchConfig(const string& filename) {
+    ifstream in(filename);
+    if (!in.is_open()) throw runtime_error("Cannot open batch file " + filename);
+
+    vector<SimConfig> configs;
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        stringstream ss(line);
+        string field;
+        vector<string> fields;
+        while (getline(ss, field, ',')) {
+            size_t b = field.find_first_not_of(" \t"), e = field.find_last_not_of(" \t\r");
+            fields.push_back(b == string::npos ? "" : field.substr(b, e - b + 1));
+        }
+        if (fields.size() < 6) throw runtime_error("Bad batch line: " + line);
+
+        SimConfig c;
+        c.inputFile = fields[0];
+        c.outputFile = fields[1];
+        c.k = stod(fields[2]);
+        c.power = stod(fields[3]);
+        c.timeStep = stod(fields[4]);
+        c.steps = stoi(fields[5]);
+        if (fields.size() > 6) c.theta = stod(fields[6]);
+        if (fields.size() > 7) c.periodicBox = stod(fields[7]);
+        configs.push_back(c);
+    }
+    return configs;
+}
+
+// Runs every configuration on a shared pool, one simulation per worker.
+// Each simulation owns its tree arena and output stream and steps single-threaded.
+inline BatchResult runBatch(const vector<SimConfig>& configs, unsigned threads = ds::hardwareThreads()) {
+    BatchResult result;
+    atomic<size_t> completed(0), failed(0);
+    atomic<long long> totalSteps(0), particleSteps(0);
+
+    auto start = chrono::high_resolution_clock::now();
+    {
+        ds::ThreadPool pool(threads);
+        for (const SimConfig& cfg : configs) {
+            pool.submit([&, cfg] {
+                try {
+                    Simulation sim;
+                    sim.setThreads(1);
+                    sim.setVerbose(false);
+                    sim.setTimeStep(cfg.timeStep);
+                    sim.setTheta(cfg.theta);
+                    sim.initFromFile(cfg.inputFile, cfg.k, cfg.power);
+                    if (cfg.periodicBox > 0) sim.enablePeriodic(cfg.periodicBox);
+                    sim.run(cfg.steps, cfg.outputFile);
+                    totalSteps += cfg.steps;
+                    particleSteps += (long long)cfg.steps * sim.size();
+                    ++completed;
+                } catch (const exception& e) {
+                    cerr << "Batch: " << cfg.inputFile << " failed: " << e.what() << "\n";
+                    ++failed;
+                }
+            });
+        }
+        pool.wait();
+    }
+    auto end = chrono::high_resolution_clock::now();
+
+    result.completed = completed;
+    result.failed = failed;
+    result.totalSteps = totalSteps;
+    result.particleSteps = particleSteps;
+    result.seconds = chrono::duration<double>(end - start).count();
+    return result;
+}
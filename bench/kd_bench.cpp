@@ -0,0 +1,112 @@
+// Quadtree vs k-d tree on anisotropic inputs: tree size and depth, build and force
+// time per step, interactions per body and the error against a direct sum.
+//   g++ -std=c++17 -O2 -pthread kd_bench.cpp -o kd_bench
+//   ./kd_bench [N ...] > kd_results.csv
+#include <iostream>
+#include <vector>
+#include <random>
+#include <string>
+#include <cmath>
+#include "../simulation.hpp"
+
+using namespace std;
+
+// disk: exponential disk seen edge-on, 100 times longer than thick
+// filament: a thin curved strand with a few dense knots along it
+// uniform: square, for reference
+ds::ParticleVector makeInput(const string& dist, size_t n, unsigned seed) {
+    mt19937_64 rng(seed);
+    uniform_real_distribution<double> uni(-100.0, 100.0), unit(0.0, 1.0), mass(50.0, 200.0);
+    normal_distribution<double> gauss(0.0, 1.0);
+
+    ds::ParticleVector ps(n);
+    for (size_t i = 0; i < n; ++i) {
+        ps[i].id = i;
+        ps[i].mass = mass(rng);
+        if (dist == "disk") {
+            double r = -30.0 * log(1.0 - unit(rng));
+            ps[i].pos = {unit(rng) < 0.5 ? -r : r, 0.3 * gauss(rng)};
+        } else if (dist == "filament") {
+            double t = uni(rng);
+            if (i % 4 == 0) t = 40.0 * floor(t / 40.0) + 20.0 + 0.5 * gauss(rng);
+            double width = 0.05 + 0.05 * abs(sin(t * 0.1));
+            ps[i].pos = {t, 20.0 * sin(t * 0.03) + width * gauss(rng)};
+        } else {
+            ps[i].pos = {uni(rng), uni(rng)};
+        }
+    }
+    return ps;
+}
+
+struct TreeRun {
+    size_t nodes = 0;
+    int depth = 0;
+    double build = 0, force = 0;   // seconds per step
+    double interactions = 0;       // per body
+    double rmsError = 0;           // relative, against the direct sum
+};
+
+// dt = 0 keeps the bodies still, so every step times the same configuration and the
+// accelerations can be checked against a direct sum at the same positions
+TreeRun measure(const ds::ParticleVector& input, ds::TreeType type, int steps) {
+    Simulation sim;
+    sim.setVerbose(false);
+    sim.setTimeStep(0.0);
+    sim.setTreeType(type);
+    sim.initFromParticles(input, 1.0, 2.0);
+    sim.step();
+
+    TreeRun r;
+    PhaseTimes before = sim.totalPhases();
+    for (int i = 0; i < steps; ++i) sim.step();
+    const PhaseTimes& after = sim.totalPhases();
+    r.build = (after.build - before.build) / steps;
+    r.force = (after.force - before.force) / steps;
+    r.interactions = sim.interactionsPerParticle();
+    if (type == ds::TreeType::KD_TREE) {
+        r.nodes = sim.getKdTree()->nodeCount();
+        r.depth = sim.getKdTree()->depth();
+    } else {
+        r.nodes = sim.getTree()->nodeCount();
+        r.depth = sim.getTree()->depth();
+    }
+
+    const ds::ParticleVector& ps = sim.getParticles();
+    size_t stride = max<size_t>(ps.size() / 500, 1), samples = 0;
+    double err = 0;
+    for (size_t i = 0; i < ps.size(); i += stride) {
+        ds::Vec2D<double> f(0.0, 0.0);
+        for (size_t j = 0; j < ps.size(); ++j) {
+            if (j == i) continue;
+            ds::Vec2D<double> d = ps[j].pos - ps[i].pos;
+            double dist = max(d.mag(), ds::SOFTENING);
+            f += d * (ps[j].mass / (dist * dist * dist));
+        }
+        if (f.magSq() > 0) err += (ps[i].acc - f).magSq() / f.magSq();
+        ++samples;
+    }
+    r.rmsError = sqrt(err / samples);
+    return r;
+}
+
+int main(int argc, char** argv) {
+    vector<size_t> sizes = {10000, 50000, 200000};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) sizes.push_back(stoul(argv[i]));
+    }
+
+    cout << "distribution, N, tree, nodes, depth, build_s, force_s, interactions_per_body, rms_rel_err\n";
+    for (string dist : {"disk", "filament", "uniform"}) {
+        for (size_t n : sizes) {
+            ds::ParticleVector input = makeInput(dist, n, 42);
+            for (ds::TreeType type : {ds::TreeType::QUADTREE, ds::TreeType::KD_TREE}) {
+                TreeRun r = measure(input, type, 3);
+                cout << dist << ", " << n << ", " << (type == ds::TreeType::KD_TREE ? "kd" : "quad") << ", "
+                     << r.nodes << ", " << r.depth << ", " << r.build << ", " << r.force << ", "
+                     << r.interactions << ", " << r.rmsError << "\n" << flush;
+            }
+        }
+    }
+    return 0;
+}
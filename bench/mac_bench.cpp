@@ -0,0 +1,122 @@
+// Opening criteria compared at equal footing: interactions per particle, force error
+// against direct summation and walk time, for a sweep of each criterion's parameter.
+//   g++ -std=c++17 -O2 -pthread mac_bench.cpp -o mac_bench
+//   ./mac_bench [N] [samples] > mac_results.csv
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include "../simulation.hpp"
+
+using namespace std;
+
+struct Setting {
+    const char* name;
+    ds::OpeningCriterion mac;
+    vector<double> params;   // theta, or the tolerance (SW: in units of the mean |acc|)
+};
+
+double quantile(vector<double> v, double q) {
+    sort(v.begin(), v.end());
+    return v[(size_t)(q * (v.size() - 1))];
+}
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? stoul(argv[1]) : 100000;
+    size_t samples = argc > 2 ? stoul(argv[2]) : 1000;
+    const double k = 1.0, power = 2.0;
+
+    vector<Setting> settings = {
+        {"geometric", ds::OpeningCriterion::GEOMETRIC, {0.3, 0.5, 0.7, 1.0}},
+        {"offset", ds::OpeningCriterion::OFFSET, {0.3, 0.5, 0.7, 1.0}},
+        {"salmon_warren", ds::OpeningCriterion::SALMON_WARREN, {1e-4, 1e-3, 1e-2}},
+        {"relative", ds::OpeningCriterion::RELATIVE, {0.0005, 0.002, 0.005, 0.02}},
+    };
+
+    cout << "dist, N, criterion, param, interactions_per_particle, median_rel_err, p99_rel_err, walk_s\n";
+    for (string dist : {"uniform", "clusters", "disk"}) {
+        ds::GeneratorConfig cfg;
+        cfg.dist = ds::parseDistribution(dist);
+        cfg.n = n;
+        cfg.seed = 7;
+        ds::ParticleVector ps = ds::generateParticles(cfg);
+
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.initFromParticles(ps, k, power);
+        ps = sim.getParticles();
+
+        double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+        for (const auto& p : ps) {
+            minX = min(minX, p.pos.x); maxX = max(maxX, p.pos.x);
+            minY = min(minY, p.pos.y); maxY = max(maxY, p.pos.y);
+        }
+        ds::BoundingBox box = {{(minX + maxX) / 2, (minY + maxY) / 2},
+                               max(maxX - minX, maxY - minY) / 2 * (1 + 1e-6)};
+
+        // direct-sum reference on an evenly spaced sample
+        size_t stride = max<size_t>(n / samples, 1);
+        vector<size_t> picks;
+        for (size_t i = 0; i < n; i += stride) picks.push_back(i);
+        vector<ds::Vec2D<double>> exact(picks.size());
+        ds::parallel_for(picks.size(), ds::hardwareThreads(), [&](size_t b, size_t e, unsigned) {
+            for (size_t s = b; s < e; ++s) {
+                const auto& p = ps[picks[s]];
+                ds::Vec2D<double> a(0.0, 0.0);
+                for (const auto& o : ps) {
+                    if (&o == &p) continue;
+                    ds::Vec2D<double> r = o.pos - p.pos;
+                    double d = max(r.mag(), ds::SOFTENING);
+                    a += r * (k * o.mass / pow(d, power) / d);
+                }
+                exact[s] = a;
+            }
+        }, 1);
+
+        // previous-step accelerations for the relative criterion, as the integrator leaves them
+        ds::BarnesHutTree tree(n * 2, 0.5);
+        tree.build(ps, box);
+        double meanAcc = 0;
+        for (auto& p : ps) {
+            p.acc = tree.getForceOn(&p, k, power) / p.mass;
+            meanAcc += p.acc.mag() / n;
+        }
+
+        for (const auto& st : settings) {
+            for (double param : st.params) {
+                ds::BarnesHutTree t(n * 2, st.mac == ds::OpeningCriterion::GEOMETRIC ||
+                                           st.mac == ds::OpeningCriterion::OFFSET ? param : 0.5);
+                if (st.mac == ds::OpeningCriterion::SALMON_WARREN) t.setOpeningCriterion(st.mac, param * meanAcc);
+                else t.setOpeningCriterion(st.mac, param);
+                t.build(ps, box);
+
+                vector<size_t> pairCounts(ds::hardwareThreads(), 0);
+                auto start = chrono::high_resolution_clock::now();
+                ds::parallel_for(n, ds::hardwareThreads(), [&](size_t b, size_t e, unsigned tid) {
+                    size_t local = 0;
+                    for (size_t i = b; i < e; ++i) {
+                        size_t pairs = 0;
+                        t.getForceOn(&ps[i], k, power, nullptr, &pairs);
+                        local += pairs;
+                    }
+                    pairCounts[tid] += local;
+                }, 256);
+                double secs = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+                size_t total = 0;
+                for (size_t c : pairCounts) total += c;
+
+                vector<double> errs;
+                for (size_t s = 0; s < picks.size(); ++s) {
+                    const auto& p = ps[picks[s]];
+                    ds::Vec2D<double> a = t.getForceOn(&p, k, power) / p.mass;
+                    errs.push_back((a - exact[s]).mag() / max(exact[s].mag(), 1e-300));
+                }
+                cout << dist << ", " << n << ", " << st.name << ", " << param << ", "
+                     << (double)total / n << ", " << quantile(errs, 0.5) << ", "
+                     << quantile(errs, 0.99) << ", " << secs << "\n" << flush;
+            }
+        }
+    }
+    return 0;
+}
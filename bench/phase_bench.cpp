@@ -0,0 +1,197 @@
+// Per-phase scaling benchmark with machine-readable baselines.
+//   g++ -std=c++17 -O2 -pthread phase_bench.cpp -o phase_bench
+//   ./phase_bench [options] > results.csv
+// Options (lists are comma separated):
+//   --sizes 1000,10000,100000   body counts (strong scaling) or bodies per thread (weak)
+//   --thetas 0.5                opening angles
+//   --threads 1,2,4             thread counts, default 1..hardware threads in powers of two
+//   --dists uniform,clusters    generator distributions, see initial_conditions.hpp
+//   --scaling strong|weak       weak scaling multiplies N by the thread count
+//   --steps 5 --warmup 1 --repeats 5
+//   --out baseline.csv          also save the results as a baseline
+//   --compare baseline.csv      exit 1 if a phase median regresses beyond --threshold
+//   --threshold 0.10            allowed relative slowdown for --compare
+//   --perf 1                    print hardware counters per phase and thread to stderr
+//   --tree quad|kd              tree of the force walk
+//   --cache-skin 0.05           keep interaction lists across steps (implies --tree kd) and
+//                               print the fraction of walks skipped to stderr
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include "../simulation.hpp"
+
+using namespace std;
+
+struct BenchOptions {
+    vector<size_t> sizes = {1000, 10000, 100000};
+    vector<double> thetas = {0.5};
+    vector<unsigned> threads;
+    vector<string> dists = {"uniform", "clusters"};
+    bool weak = false;
+    int steps = 5, warmup = 1, repeats = 5;
+    string out, compare;
+    double threshold = 0.10;
+    bool perf = false;
+    ds::TreeType tree = ds::TreeType::QUADTREE;
+    double cacheSkin = 0;
+};
+
+struct PhaseStats {
+    string key;   // dist,N,theta,threads,phase
+    double median, p25, p75, min, max;
+};
+
+template<class T>
+vector<T> parseList(const string& s) {
+    vector<T> out;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) {
+        stringstream conv(item);
+        double v;
+        if constexpr (is_same<T, string>::value) out.push_back(item);
+        else if (conv >> v) out.push_back((T)v);
+    }
+    return out;
+}
+
+double quantile(vector<double> v, double q) {
+    sort(v.begin(), v.end());
+    double idx = q * (v.size() - 1);
+    size_t lo = (size_t)idx, hi = min(lo + 1, v.size() - 1);
+    return v[lo] + (v[hi] - v[lo]) * (idx - lo);
+}
+
+// One configuration: per-step phase times of each repeat, after warm-up steps.
+vector<PhaseTimes> runCase(const string& dist, size_t n, double theta, unsigned threads, const BenchOptions& opt) {
+    ds::GeneratorConfig cfg;
+    cfg.dist = ds::parseDistribution(dist);
+    cfg.n = n;
+    cfg.seed = 42;
+
+    Simulation sim;
+    sim.setVerbose(false);
+    sim.setThreads(threads);
+    sim.setTheta(theta);
+    sim.setTreeType(opt.tree);
+    sim.setInteractionCache(opt.cacheSkin);
+    sim.initFromParticles(ds::generateParticles(cfg), 1.0, 2.0);
+    for (int i = 0; i < opt.warmup; ++i) sim.step();
+    if (opt.perf && !sim.enablePerfCounters()) cerr << "perf counters unavailable, timing only\n";
+
+    vector<PhaseTimes> samples;
+    for (int r = 0; r < opt.repeats; ++r) {
+        PhaseTimes before = sim.totalPhases(), acc;
+        for (int i = 0; i < opt.steps; ++i) sim.step();
+        const PhaseTimes& after = sim.totalPhases();
+        acc.sort = (after.sort - before.sort) / opt.steps;
+        acc.build = (after.build - before.build) / opt.steps;
+        acc.force = (after.force - before.force) / opt.steps;
+        acc.integrate = (after.integrate - before.integrate) / opt.steps;
+        acc.forceIdle = (after.forceIdle - before.forceIdle) / opt.steps;
+        samples.push_back(acc);
+    }
+    if (opt.perf) sim.printPerfReport(cerr);
+    if (opt.cacheSkin > 0) {
+        const ds::ListCacheStats& st = sim.listCacheStats();
+        cerr << "interaction lists: " << st.rebuilds << " rebuilds, " << st.skippedFraction() * 100 << "% of walks skipped\n";
+    }
+    return samples;
+}
+
+map<string, double> loadBaseline(const string& filename) {
+    ifstream in(filename);
+    if (!in.is_open()) throw runtime_error("Cannot open baseline " + filename);
+    map<string, double> medians;
+    string line;
+    getline(in, line); // header
+    while (getline(in, line)) {
+        vector<string> f = parseList<string>(line);
+        if (f.size() < 6) continue;
+        medians[f[0] + "," + f[1] + "," + f[2] + "," + f[3] + "," + f[4]] = stod(f[5]);
+    }
+    return medians;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions opt;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string a = argv[i], v = argv[i + 1];
+        if (a == "--sizes") opt.sizes = parseList<size_t>(v);
+        else if (a == "--thetas") opt.thetas = parseList<double>(v);
+        else if (a == "--threads") opt.threads = parseList<unsigned>(v);
+        else if (a == "--dists") opt.dists = parseList<string>(v);
+        else if (a == "--scaling") opt.weak = (v == "weak");
+        else if (a == "--steps") opt.steps = stoi(v);
+        else if (a == "--warmup") opt.warmup = stoi(v);
+        else if (a == "--repeats") opt.repeats = stoi(v);
+        else if (a == "--out") opt.out = v;
+        else if (a == "--compare") opt.compare = v;
+        else if (a == "--threshold") opt.threshold = stod(v);
+        else if (a == "--perf") opt.perf = (v != "0");
+        else if (a == "--tree") opt.tree = (v == "kd") ? ds::TreeType::KD_TREE : ds::TreeType::QUADTREE;
+        else if (a == "--cache-skin") opt.cacheSkin = stod(v);
+        else { cerr << "Unknown option " << a << "\n"; return 2; }
+    }
+    if (opt.cacheSkin > 0) opt.tree = ds::TreeType::KD_TREE;
+    if (opt.threads.empty()) {
+        for (unsigned t = 1; t <= ds::hardwareThreads(); t *= 2) opt.threads.push_back(t);
+    }
+
+    vector<PhaseStats> results;
+    for (const string& dist : opt.dists)
+    for (size_t base : opt.sizes)
+    for (double theta : opt.thetas)
+    for (unsigned threads : opt.threads) {
+        size_t n = opt.weak ? base * threads : base;
+        vector<PhaseTimes> samples = runCase(dist, n, theta, threads, opt);
+
+        const char* names[] = {"sort", "build", "force", "integrate", "total", "force_idle"};
+        for (int ph = 0; ph < 6; ++ph) {
+            vector<double> v;
+            for (const auto& s : samples) {
+                double vals[] = {s.sort, s.build, s.force, s.integrate, s.total(), s.forceIdle};
+                v.push_back(vals[ph]);
+            }
+            ostringstream key;
+            key << dist << "," << n << "," << theta << "," << threads << "," << names[ph];
+            results.push_back({key.str(), quantile(v, 0.5), quantile(v, 0.25), quantile(v, 0.75),
+                               *min_element(v.begin(), v.end()), *max_element(v.begin(), v.end())});
+        }
+        cerr << "done " << dist << " N=" << n << " theta=" << theta << " threads=" << threads << "\n";
+    }
+
+    ostringstream csv;
+    csv << "dist,N,theta,threads,phase,median_s,p25_s,p75_s,min_s,max_s\n";
+    for (const auto& r : results) {
+        csv << r.key << "," << r.median << "," << r.p25 << "," << r.p75 << "," << r.min << "," << r.max << "\n";
+    }
+    cout << csv.str();
+    if (!opt.out.empty()) {
+        ofstream out(opt.out);
+        out << csv.str();
+    }
+
+    if (!opt.compare.empty()) {
+        map<string, double> base = loadBaseline(opt.compare);
+        int regressions = 0;
+        for (const auto& r : results) {
+            auto it = base.find(r.key);
+            if (it == base.end() || it->second <= 0) continue;
+            double change = r.median / it->second - 1.0;
+            if (change > opt.threshold) {
+                cerr << "REGRESSION " << r.key << ": " << it->second << "s -> " << r.median
+                     << "s (+" << change * 100 << "%)\n";
+                ++regressions;
+            }
+        }
+        cerr << (regressions ? "FAILED: " : "OK: ") << regressions << " phase regressions beyond "
+             << opt.threshold * 100 << "%\n";
+        return regressions ? 1 : 0;
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+import sys
+import pandas as pd
+import matplotlib.pyplot as plt
+
+# Usage: python plot_phases.py phase_results.csv
+df = pd.read_csv(sys.argv[1] if len(sys.argv) > 1 else 'phase_results.csv')
+phases = ['sort', 'build', 'force', 'integrate']
+
+fig, (ax1, ax2) = plt.subplots(1, 2, figsize=(14, 6))
+
+# per-phase median step time against N, single thread
+one = df[(df['threads'] == df['threads'].min()) & (df['phase'].isin(phases))]
+for (dist, phase), g in one.groupby(['dist', 'phase']):
+    g = g.sort_values('N')
+    ax1.errorbar(g['N'], g['median_s'], yerr=[g['median_s'] - g['p25_s'], g['p75_s'] - g['median_s']],
+                 marker='o', capsize=3, label=f'{dist} {phase}')
+ax1.set_xscale('log')
+ax1.set_yscale('log')
+ax1.set_xlabel('Number of Particles ($N$)')
+ax1.set_ylabel('Median time per step (seconds)')
+ax1.set_title('Step phases')
+ax1.legend(fontsize=8)
+ax1.grid(True, linestyle='--', alpha=0.7)
+
+# speedup of the whole step against thread count, largest N
+total = df[df['phase'] == 'total']
+for dist, g in total[total['N'] == total['N'].max()].groupby('dist'):
+    g = g.sort_values('threads')
+    ax2.plot(g['threads'], g['median_s'].iloc[0] / g['median_s'], 'o-', label=dist)
+ax2.plot(total['threads'].unique(), total['threads'].unique(), 'k--', alpha=0.5, label='ideal')
+ax2.set_xlabel('Threads')
+ax2.set_ylabel('Speedup')
+ax2.set_title('Thread scaling')
+ax2.legend()
+ax2.grid(True, linestyle='--', alpha=0.7)
+
+plt.savefig("phase_comparison.png", dpi=300, bbox_inches="tight")
+plt.close()
@@ -0,0 +1,73 @@
+// TreePM vs pure Barnes-Hut step time on uniform and clustered inputs.
+//   g++ -std=c++17 -O2 -pthread treepm_bench.cpp -o treepm_bench
+//   ./treepm_bench [N ...] > treepm_results.csv
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <string>
+#include "../simulation.hpp"
+
+using namespace std;
+
+ds::ParticleVector makeInput(const string& dist, size_t n, unsigned seed) {
+    mt19937_64 rng(seed);
+    uniform_real_distribution<double> uni(-100.0, 100.0), mass(50.0, 200.0);
+    normal_distribution<double> gauss(0.0, 4.0);
+    vector<ds::Vec2D<double>> centres;
+    for (int c = 0; c < 8; ++c) centres.push_back({uni(rng), uni(rng)});
+
+    ds::ParticleVector ps(n);
+    for (size_t i = 0; i < n; ++i) {
+        ps[i].id = i;
+        ps[i].mass = mass(rng);
+        if (dist == "uniform") {
+            ps[i].pos = {uni(rng), uni(rng)};
+        } else {
+            const auto& c = centres[i % centres.size()];
+            ps[i].pos = {c.x + gauss(rng), c.y + gauss(rng)};
+        }
+    }
+    return ps;
+}
+
+// mean seconds per step after one warm-up step; acc of the first step is kept for comparison
+double timeSolver(const ds::ParticleVector& input, ds::SolverType solver, int steps, ds::ParticleVector& firstStep) {
+    Simulation sim;
+    sim.setVerbose(false);
+    sim.initFromParticles(input, 1.0, 2.0);
+    sim.setSolver(solver);
+    sim.step();
+    firstStep = sim.getParticles();
+
+    auto start = chrono::high_resolution_clock::now();
+    for (int i = 0; i < steps; ++i) sim.step();
+    auto end = chrono::high_resolution_clock::now();
+    return chrono::duration<double>(end - start).count() / steps;
+}
+
+int main(int argc, char** argv) {
+    vector<size_t> sizes = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) sizes.push_back(stoul(argv[i]));
+    }
+
+    cout << "distribution, N, tree_step_s, treepm_step_s, speedup, rms_rel_acc_diff\n";
+    for (string dist : {"uniform", "clustered"}) {
+        for (size_t n : sizes) {
+            ds::ParticleVector input = makeInput(dist, n, 42), a, b;
+            double tTree = timeSolver(input, ds::SolverType::BARNES_HUT, 3, a);
+            double tPM = timeSolver(input, ds::SolverType::TREE_PM, 3, b);
+
+            double err = 0;
+            for (size_t i = 0; i < n; ++i) {
+                double ref = a[i].acc.magSq();
+                if (ref > 0) err += (a[i].acc - b[i].acc).magSq() / ref;
+            }
+            cout << dist << ", " << n << ", " << tTree << ", " << tPM << ", "
+                 << tTree / tPM << ", " << sqrt(err / n) << "\n" << flush;
+        }
+    }
+    return 0;
+}
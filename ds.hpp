@@ -1,8 +1,21 @@
 #pragma once
 #include <memory>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <stdexcept>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 
 using namespace std;
@@ -15,8 +28,25 @@ constexpr double COULOMB_K = 8.98755e9;
 constexpr double THETA_DEFAULT = 0.5;
 constexpr double SOFTENING = 1e-5;
 constexpr double eps = 1e-8;
+// bodies further than ESCAPE_FACTOR core half-widths from the core centre are treated as escapers
+constexpr double ESCAPE_FACTOR = 4.0;
+// below this many items per thread, parallel_for just runs inline
+constexpr size_t PARALLEL_GRAIN = 4096;
 
 // enum class ForceType { GRAVITY, ELECTRIC, LENNARD_JONES, CUSTOM };
+// CELL_LIST: cutoff-radius Verlet lists for short-range laws, see neighbors.hpp
+enum class SolverType { BARNES_HUT, TREE_PM, CELL_LIST };
+// Tree of the tree-walking solvers: equal quadrants, or KD_TREE (kdtree.hpp), balanced
+// splits with tight boxes for thin disks and filaments
+enum class TreeType { QUADTREE, KD_TREE };
+// When a node may stand in for its bodies:
+//   GEOMETRIC      s / r < theta (cell width over distance to the CoM)
+//   OFFSET         r > s / theta + delta, delta = CoM offset from the cell centre (Barnes 1994),
+//                  so cells with off-centre mass open earlier
+//   SALMON_WARREN  bounded monopole error k * c * B2 / (r - bmax)^(n+2) below an absolute tolerance,
+//                  bmax = furthest body from the CoM
+//   RELATIVE       k M s^2 / r^(n+2) below tolerance * |previous acc| (geometric on the first step)
+enum class OpeningCriterion { GEOMETRIC, OFFSET, SALMON_WARREN, RELATIVE };
 // enum class IntegratorType { EULER, SYMPLECTIC_EULER, VERLET, RK4 };
 
 template<typename T>
@@ -99,20 +129,35 @@ template<typename T>
 class DynamicArray {
 private:
     T* arr;
-    size_t capacity;
+    size_t cap;
     size_t sz;
 
-    void resize() {
-        capacity = (capacity == 0) ? 1 : capacity * 2;
-        T* newArr = new T[capacity];
-        for (size_t i = 0; i < sz; ++i) newArr[i] = arr[i];
+    void reallocate(size_t newCap) {
+        T* newArr = new T[newCap];
+        for (size_t i = 0; i < sz; ++i) newArr[i] = std::move(arr[i]);
         delete[] arr;
         arr = newArr;
+        cap = newCap;
     }
 
 public:
-    DynamicArray(size_t cap = 2) : capacity(cap ? cap : 2), sz(0) {
-        arr = new T[capacity];
+    DynamicArray(size_t capacity = 2) : cap(capacity ? capacity : 2), sz(0) {
+        arr = new T[cap];
+    }
+
+    DynamicArray(const DynamicArray& o) : cap(o.cap), sz(o.sz) {
+        arr = new T[cap];
+        for (size_t i = 0; i < sz; ++i) arr[i] = o.arr[i];
+    }
+    DynamicArray(DynamicArray&& o) noexcept : arr(o.arr), cap(o.cap), sz(o.sz) {
+        o.arr = nullptr;
+        o.cap = o.sz = 0;
+    }
+    DynamicArray& operator= (DynamicArray o) noexcept {
+        swap(arr, o.arr);
+        swap(cap, o.cap);
+        swap(sz, o.sz);
+        return *this;
     }
 
     ~DynamicArray() {
@@ -120,15 +165,23 @@ public:
     }
 
     void push(const T& value) {
-        if (sz == capacity) resize();
+        if (sz == cap) reallocate(max<size_t>(cap * 2, 1));
         arr[sz++] = value;
     }
+    void push(T&& value) {
+        if (sz == cap) reallocate(max<size_t>(cap * 2, 1));
+        arr[sz++] = std::move(value);
+    }
 
     void pop() {
         if (sz > 0) --sz;
     }
 
-    T get(size_t index) const {
+    const T& get(size_t index) const {
+        if (index >= sz) throw out_of_range("DynamicArray::get: index out of range");
+        return arr[index];
+    }
+    T& get(size_t index) {
         if (index >= sz) throw out_of_range("DynamicArray::get: index out of range");
         return arr[index];
     }
@@ -138,15 +191,188 @@ public:
         arr[index] = value;
     }
 
+    // unchecked, for hot loops that already know the bounds
+    T& operator[] (size_t index) { return arr[index]; }
+    const T& operator[] (size_t index) const { return arr[index]; }
+
+    // grows the storage to at least n, never shrinks
+    void reserve(size_t n) {
+        if (n > cap) reallocate(n);
+    }
+    // empties the array but keeps its storage for reuse
+    void clear() { sz = 0; }
+
     size_t length() const { return sz; }
+    size_t capacity() const { return cap; }
     bool empty() const { return sz == 0; }
 
+    T* data() { return arr; }
+    const T* data() const { return arr; }
+    T* begin() { return arr; }
+    T* end() { return arr + sz; }
+    const T* begin() const { return arr; }
+    const T* end() const { return arr + sz; }
+
     void print() const {
         for (size_t i = 0; i < sz; ++i) cout << arr[i] << " ";
         cout << endl;
     }
 };
 
+inline unsigned hardwareThreads() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Runs fn(ctx, t) for every t in [0, tasks) and returns once all are done; the calling
+// thread takes part. Defined after ThreadPool, whose persistent workers run the rest.
+inline void forkJoin(unsigned tasks, void (*fn)(void*, unsigned), void* ctx);
+
+// Static split of [0, n) into contiguous chunks, body(begin, end, threadIdx).
+// Small ranges run on the calling thread so the serial path stays cheap.
+template<class F>
+void parallel_for(size_t n, unsigned threads, F body, size_t grain = PARALLEL_GRAIN) {
+    size_t useful = n / max<size_t>(grain, 1);
+    if (useful < threads) threads = (unsigned)max<size_t>(useful, 1);
+    if (threads <= 1) {
+        body(size_t(0), n, 0u);
+        return;
+    }
+    size_t chunk = (n + threads - 1) / threads;
+    auto task = [&](unsigned t) {
+        size_t b = min(n, t * chunk);
+        body(b, min(n, b + chunk), t);
+    };
+    forkJoin(threads, [](void* c, unsigned t) { (*static_cast<decltype(task)*>(c))(t); }, &task);
+}
+
+// 64-bit mixer, used for seeding and hashing
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Z-order code of two 32-bit cell coordinates, x in the even bits
+inline uint64_t mortonCode(uint32_t x, uint32_t y) {
+    auto spread = [](uint64_t v) {
+        v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+        v = (v | (v << 8)) & 0x00ff00ff00ff00ffULL;
+        v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        v = (v | (v << 2)) & 0x3333333333333333ULL;
+        v = (v | (v << 1)) & 0x5555555555555555ULL;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// parallel_for over explicit zones: worker t gets [bounds[t], bounds[t+1])
+template<typename F>
+void parallel_zones(const std::vector<size_t>& bounds, F body) {
+    unsigned threads = (unsigned)bounds.size() - 1;
+    if (threads <= 1) {
+        body(bounds.front(), bounds.back(), 0u);
+        return;
+    }
+    auto task = [&](unsigned t) { body(bounds[t], bounds[t + 1], t); };
+    forkJoin(threads, [](void* c, unsigned t) { (*static_cast<decltype(task)*>(c))(t); }, &task);
+}
+
+// Large arrays (particles, node pools) are mapped on 2 MiB boundaries and asked for
+// huge pages, so tree walks touch far fewer TLB entries. No NUMA placement is
+// attempted: pages land wherever the thread that first writes them runs.
+// Small arrays, non-Linux builds and refused huge pages fall back to normal pages.
+constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+constexpr size_t LARGE_ARRAY_BYTES = size_t(1) << 20;
+
+struct LargeArrayConfig {
+    std::atomic<bool> explicitHugePages{false}; // MAP_HUGETLB first (needs a reserved pool), else THP only
+};
+
+inline LargeArrayConfig& largeArrayConfig() {
+    static LargeArrayConfig cfg;
+    return cfg;
+}
+
+inline void setExplicitHugePages(bool on) { largeArrayConfig().explicitHugePages = on; }
+
+// bytes currently held through allocateLargeArray, mapped lengths for mapped arrays
+inline std::atomic<size_t>& largeArrayBytesInUse() {
+    static std::atomic<size_t> bytes(0);
+    return bytes;
+}
+
+inline size_t largeArrayLength(size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+inline void* allocateLargeArray(size_t bytes) {
+#ifdef __linux__
+    if (bytes >= LARGE_ARRAY_BYTES) {
+        size_t len = largeArrayLength(bytes);
+        void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (largeArrayConfig().explicitHugePages)
+            p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+            // mmap only promises 4 KiB alignment: map one huge page extra and trim both
+            // ends so the array starts on a 2 MiB boundary THP can back
+            char* raw = static_cast<char*>(mmap(nullptr, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (raw == MAP_FAILED) throw std::bad_alloc();
+            uintptr_t addr = reinterpret_cast<uintptr_t>(raw);
+            char* aligned = raw + ((HUGE_PAGE_SIZE - addr % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE);
+            if (aligned > raw) munmap(raw, aligned - raw);
+            size_t tail = raw + len + HUGE_PAGE_SIZE - (aligned + len);
+            if (tail) munmap(aligned + len, tail);
+            p = aligned;
+#ifdef MADV_HUGEPAGE
+            madvise(p, len, MADV_HUGEPAGE); // advisory, ignored without THP
+#endif
+        }
+        largeArrayBytesInUse().fetch_add(len, std::memory_order_relaxed);
+        return p;
+    }
+#endif
+    void* p = ::operator new(bytes);
+    largeArrayBytesInUse().fetch_add(bytes, std::memory_order_relaxed);
+    return p;
+}
+
+inline void freeLargeArray(void* p, size_t bytes) noexcept {
+    if (!p) return;
+#ifdef __linux__
+    if (bytes >= LARGE_ARRAY_BYTES) {
+        munmap(p, largeArrayLength(bytes));
+        largeArrayBytesInUse().fetch_sub(largeArrayLength(bytes), std::memory_order_relaxed);
+        return;
+    }
+#endif
+    ::operator delete(p);
+    largeArrayBytesInUse().fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+// std allocator over allocateLargeArray; stateless, so containers swap and move freely.
+template<typename T>
+class LargeArrayAllocator {
+public:
+    using value_type = T;
+
+    LargeArrayAllocator() noexcept {}
+    template<typename U> LargeArrayAllocator(const LargeArrayAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) throw std::bad_array_new_length();
+        return static_cast<T*>(allocateLargeArray(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) noexcept { freeLargeArray(p, n * sizeof(T)); }
+
+    template<typename U> bool operator== (const LargeArrayAllocator<U>&) const noexcept { return true; }
+    template<typename U> bool operator!= (const LargeArrayAllocator<U>&) const noexcept { return false; }
+};
+
 template <typename T>
 class Vec2D{
 public:
@@ -210,11 +436,15 @@ struct Particle {
     double mass;
     double charge;
     bool isStatic;
+    uint32_t cost; // pair interactions of the last force walk, for load balancing
 
     Particle(size_t _id = 0)
-        : id(_id), pos(0,0), vel(0,0), acc(0,0), mass(1.0), charge(0.0), isStatic(false) {}
+        : id(_id), pos(0,0), vel(0,0), acc(0,0), mass(1.0), charge(0.0), isStatic(false), cost(0) {}
 };
 
+// the body arrays of a simulation, placed by LargeArrayAllocator
+using ParticleVector = std::vector<Particle, LargeArrayAllocator<Particle>>;
+
 
 struct BoundingBox {
     Vec2D<double> center;
@@ -235,12 +465,145 @@ struct BoundingBox {
     }
 };
 
+// Regularized lower incomplete gamma P(a, x): series below a+1, continued fraction above.
+inline double gammaP(double a, double x) {
+    if (x <= 0) return 0;
+    double lead = exp(a * log(x) - x - lgamma(a));
+    if (x < a + 1) {
+        double term = 1.0 / a, sum = term;
+        for (int n = 1; n < 500 && abs(term) > abs(sum) * 1e-15; ++n) {
+            term *= x / (a + n);
+            sum += term;
+        }
+        return sum * lead;
+    }
+    // Lentz's method for Q(a, x)
+    double b = x + 1 - a, c = 1e300, d = 1 / b, h = d;
+    for (int n = 1; n < 500; ++n) {
+        double an = -n * (n - a);
+        b += 2;
+        d = an * d + b; if (abs(d) < 1e-300) d = 1e-300;
+        c = b + an / c; if (abs(c) < 1e-300) c = 1e-300;
+        d = 1 / d;
+        double del = d * c;
+        h *= del;
+        if (abs(del - 1) < 1e-15) break;
+    }
+    return 1 - lead * h;
+}
+
+// Smooth split of a 1/r^power force into short and long range parts (TreePM).
+// The long part is f(r) * P((power+1)/2, r^2 / 4rs^2), which vanishes like r^(power+1)
+// at the origin so a mesh can resolve it; for power 2 this is the usual
+// erf(x) - 2x/sqrt(pi) exp(-x^2) split. The short factor 1 - P is tabulated up to the cutoff.
+class ForceSplit {
+private:
+    std::vector<double> shortTable;
+    double rs;
+    double rcut;
+    double power;
+    double step;
+
+public:
+    ForceSplit() : rs(0), rcut(0), power(0), step(0) {}
+
+    void build(double _power, double _rs, double _rcut, size_t samples = 1024) {
+        if (_power == power && _rs == rs && _rcut == rcut) return;
+        power = _power; rs = _rs; rcut = _rcut;
+        step = rcut / samples;
+        shortTable.resize(samples + 2);
+        for (size_t i = 0; i < shortTable.size(); ++i) shortTable[i] = shortFactorExact(i * step);
+    }
+
+    double longFactorExact(double r) const {
+        return gammaP((power + 1) / 2, r * r / (4 * rs * rs));
+    }
+    double shortFactorExact(double r) const { return 1 - longFactorExact(r); }
+
+    double shortFactor(double r) const {
+        double t = r / step;
+        size_t i = (size_t)t;
+        if (i + 1 >= shortTable.size()) return 0;
+        double f = t - i;
+        return shortTable[i] * (1 - f) + shortTable[i + 1] * f;
+    }
+
+    double splitRadius() const { return rs; }
+    double cutoff() const { return rcut; }
+};
+
+// Periodic-image correction for a k*m1*m2/r^power law in a square box of side L.
+// The tree walk handles the minimum image; this table holds the sum over all other
+// images, precomputed once on a grid over [0, L/2]^2 and bilinearly interpolated.
+// Images are summed directly out to `shells` boxes, the rest is a continuum tail term.
+class EwaldTable {
+private:
+    std::vector<Vec2D<double>> table;
+    size_t grid;
+    double boxSize;
+    double cellSize;
+
+    static Vec2D<double> imageSum(const Vec2D<double>& d, double L, double power, int shells) {
+        Vec2D<double> sum(0.0, 0.0);
+        for (int nx = -shells; nx <= shells; ++nx) {
+            for (int ny = -shells; ny <= shells; ++ny) {
+                if (nx == 0 && ny == 0) continue;
+                Vec2D<double> r(d.x + nx * L, d.y + ny * L);
+                double dist = r.mag();
+                sum += r * (1.0 / (pow(dist, power) * dist));
+            }
+        }
+        // images beyond the last shell, smeared into a uniform sheet outside a disk of
+        // equal area: only the divergence (1-p)/r^(p+1) of the law survives the symmetry
+        if (power > 1.0) {
+            double a = (2.0 * shells + 1.0) * L / sqrt(M_PI);
+            sum += d * (-M_PI * pow(a, 1.0 - power) / (L * L));
+        }
+        return sum;
+    }
+
+public:
+    EwaldTable() : grid(0), boxSize(0), cellSize(0) {}
+
+    void build(double L, double power, size_t _grid = 32, int shells = 16) {
+        grid = _grid;
+        boxSize = L;
+        cellSize = (L / 2.0) / grid;
+        table.assign((grid + 1) * (grid + 1), Vec2D<double>(0.0, 0.0));
+        for (size_t i = 0; i <= grid; ++i) {
+            for (size_t j = 0; j <= grid; ++j) {
+                table[i * (grid + 1) + j] = imageSum({i * cellSize, j * cellSize}, L, power, shells);
+            }
+        }
+    }
+
+    bool empty() const { return table.empty(); }
+
+    // d is a minimum-image separation; result is per unit k*m1*m2
+    Vec2D<double> correction(const Vec2D<double>& d) const {
+        double ax = min(abs(d.x) / cellSize, (double)grid), ay = min(abs(d.y) / cellSize, (double)grid);
+        size_t i = min((size_t)ax, grid - 1), j = min((size_t)ay, grid - 1);
+        double fx = ax - i, fy = ay - j;
+        const Vec2D<double>* row0 = &table[i * (grid + 1) + j];
+        const Vec2D<double>* row1 = row0 + (grid + 1);
+        Vec2D<double> c = row0[0] * ((1 - fx) * (1 - fy)) + row0[1] * ((1 - fx) * fy)
+                        + row1[0] * (fx * (1 - fy)) + row1[1] * (fx * fy);
+        // the correction is odd in each component
+        if (d.x < 0) c.x = -c.x;
+        if (d.y < 0) c.y = -c.y;
+        return c;
+    }
+};
+
 class QuadNode {
 public:
     BoundingBox bounds;
     
     double totalMass;
     Vec2D<double> centerOfMass;
+    // furthest body from the CoM and sum of m |x - CoM|^2, filled only for the criteria using them
+    double bmax;
+    double quadMoment;
     Particle* body;
     QuadNode* children[4]; 
     bool isLeaf;
@@ -248,6 +611,8 @@ public:
     QuadNode(){
         totalMass = 0;
         centerOfMass = {0, 0};
+        bmax = 0;
+        quadMoment = 0;
         body = nullptr;
         isLeaf = true; 
         for(int i=0; i<4; ++i) children[i] = nullptr;
@@ -257,6 +622,8 @@ public:
         bounds = b;
         totalMass = 0;
         centerOfMass = {0,0};
+        bmax = 0;
+        quadMoment = 0;
         body = nullptr;
         isLeaf = true;
         for(int i=0; i<4; ++i) children[i] = nullptr;
@@ -267,7 +634,7 @@ public:
 template<typename T>
 class BlockAllocator {
 private:
-    std::vector<T> memory_pool;
+    std::vector<T, LargeArrayAllocator<T>> memory_pool;
     size_t current_index;
 
 public:
@@ -290,13 +657,76 @@ public:
     size_t used_memory() const {
         return current_index * sizeof(T);
     }
+
+    // Doubles the pool; invalidates every pointer handed out so far.
+    void grow() {
+        memory_pool.clear();
+        memory_pool.resize(max<size_t>(memory_pool.capacity() * 2, 16));
+        current_index = 0;
+    }
+};
+
+// One tree node as seen by level-of-detail output.
+struct NodeAggregate {
+    Vec2D<double> centerOfMass;
+    double totalMass;
+    double size; // cell side, 0 for a single body
+};
+
+// one particle's walk: force, plus its potential energy when asked for
+struct WalkResult {
+    Vec2D<double> force;
+    double potential = 0;
+    bool wantPotential = false;
+    size_t interactions = 0;
 };
 
+// U(r) = k m1 m2 r^(1-n) / (1-n), or k m1 m2 ln r for n = 1; reuses the force's pow
+inline void accumulatePair(WalkResult& w, const Vec2D<double>& rVec, double r, double m1, double m2,
+                           double k, double power, double shortFactor = 1.0) {
+    double dist = max(r, SOFTENING);
+    double fMag = (k * m1 * m2) / pow(dist, power);
+    w.force += rVec * (fMag * shortFactor / dist);
+    ++w.interactions;
+    if (w.wantPotential) {
+        w.potential += (power == 1.0) ? k * m1 * m2 * log(dist) : fMag * dist / (1.0 - power);
+    }
+}
+
 class BarnesHutTree {
 private:
     QuadNode* root;
     BlockAllocator<QuadNode> allocator;
     double theta;
+    // bodies outside worldBounds, summed directly instead of deepening the tree
+    std::vector<Particle*> outliers;
+    // the bodies of the last build, for the all-pairs sweep
+    ParticleVector* bodies;
+    // per-thread pair buffers of closePairs, kept between calls
+    std::vector<std::vector<std::pair<Particle*, Particle*>>> pairScratch;
+    // periodic mode (box side > 0): minimum-image separations plus the Ewald table
+    double periodicBox;
+    const EwaldTable* ewald;
+    // TreePM short-range mode: split law, nodes beyond the cutoff skipped
+    const ForceSplit* split;
+    OpeningCriterion mac;
+    double macTolerance;
+    // root-to-leaf path of the last incremental edit
+    std::vector<QuadNode*> editPath;
+
+    // distance from p to the nearest point of the box, 0 inside
+    static double boxDistance(const BoundingBox& b, const Vec2D<double>& p) {
+        double dx = max(abs(p.x - b.center.x) - b.halfDim, 0.0);
+        double dy = max(abs(p.y - b.center.y) - b.halfDim, 0.0);
+        return sqrt(dx * dx + dy * dy);
+    }
+
+    Vec2D<double> minImage(Vec2D<double> d) const {
+        double h = periodicBox * 0.5;
+        if (d.x > h) d.x -= periodicBox; else if (d.x < -h) d.x += periodicBox;
+        if (d.y > h) d.y -= periodicBox; else if (d.y < -h) d.y += periodicBox;
+        return d;
+    }
 
     //index (NW=0, NE=1, SW=2, SE=3)
     int getQuadrant(const BoundingBox& b, const Vec2D<double>& p)const{
@@ -338,8 +768,11 @@ private:
 
         // occupied leaf, subdivide and re-insert both
         if (node->isLeaf && node->body != nullptr) {
+            // (near-)coincident: step p off the resident body towards the cell centre, at
+            // most half the cell, so the two stay inside and part at the next split
             if ((node->body->pos - p->pos).magSq() < eps) {
-                p->pos.x += 1e-5; 
+                double step = min(1e-5, node->bounds.halfDim);
+                p->pos.x = node->body->pos.x + (node->body->pos.x < node->bounds.center.x ? step : -step);
             }
 
             Particle* oldBody = node->body;
@@ -366,52 +799,473 @@ private:
         }
     }
 
-    Vec2D<double> computeForceRecursive(QuadNode* node, const Particle* p, double k, double power) const {
-        if (!node || node->totalMass <= 0) return Vec2D(0.0,0.0);
+    // bmax and quadMoment bottom-up from the children (parallel axis theorem)
+    void computeMoments(QuadNode* node) {
+        node->bmax = 0;
+        node->quadMoment = 0;
+        if (node->isLeaf) return;
+        for (int i = 0; i < 4; ++i) {
+            QuadNode* c = node->children[i];
+            if (!c || c->totalMass <= 0) continue;
+            computeMoments(c);
+            double d = (c->centerOfMass - node->centerOfMass).mag();
+            node->bmax = max(node->bmax, d + c->bmax);
+            node->quadMoment += c->quadMoment + c->totalMass * d * d;
+        }
+    }
+
+    bool usesMoments() const { return mac == OpeningCriterion::SALMON_WARREN || mac == OpeningCriterion::RELATIVE; }
+
+    // leaf whose box holds p's position; editPath receives the internal nodes above it
+    QuadNode* descend(const Particle* p) {
+        editPath.clear();
+        QuadNode* node = root;
+        while (!node->isLeaf) {
+            editPath.push_back(node);
+            node = node->children[getQuadrant(node->bounds, p->pos)];
+        }
+        return node;
+    }
+
+    // Recomputes an internal node from its children after an edit below it. A node left
+    // with at most one body among leaf children becomes a leaf again, as a rebuild would have it.
+    void refreshNode(QuadNode* node) {
+        double m = 0;
+        Vec2D<double> weighted(0.0, 0.0);
+        int bodiesBelow = 0;
+        bool allLeaves = true;
+        Particle* only = nullptr;
+        for (QuadNode* c : node->children) {
+            if (!c->isLeaf) allLeaves = false;
+            else if (c->body) { ++bodiesBelow; only = c->body; }
+            if (c->totalMass <= 0) continue;
+            m += c->totalMass;
+            weighted += c->centerOfMass * c->totalMass;
+        }
+        node->totalMass = m;
+        node->centerOfMass = m > 0 ? weighted * (1.0 / m) : node->bounds.center;
+        if (allLeaves && bodiesBelow <= 1) {
+            node->isLeaf = true;
+            node->body = only;
+            for (QuadNode*& c : node->children) c = nullptr;
+        }
+        node->bmax = 0;
+        node->quadMoment = 0;
+        if (node->isLeaf || !usesMoments()) return;
+        for (QuadNode* c : node->children) {
+            if (c->totalMass <= 0) continue;
+            double d = (c->centerOfMass - node->centerOfMass).mag();
+            node->bmax = max(node->bmax, d + c->bmax);
+            node->quadMoment += c->quadMoment + c->totalMass * d * d;
+        }
+    }
+
+    bool acceptNode(const QuadNode* node, const Particle* p, double r, double k, double power) const {
+        double s = node->bounds.halfDim * 2.0;
+        // x^(n+2), inverse square law without pow()
+        auto powN2 = [power](double x) { return power == 2.0 ? (x * x) * (x * x) : pow(x, power + 2.0); };
+        switch (mac) {
+        case OpeningCriterion::OFFSET:
+            return r * theta > s + theta * (node->centerOfMass - node->bounds.center).mag();
+        case OpeningCriterion::SALMON_WARREN: {
+            if (r <= node->bmax) return false;
+            // quadrupole-order bound, c = (n+1)(n+2)/4 gives the classic 3 B2 for n = 2
+            double c = (power + 1.0) * (power + 2.0) / 4.0;
+            return k * c * node->quadMoment <= macTolerance * powN2(r - node->bmax);
+        }
+        case OpeningCriterion::RELATIVE: {
+            double aOld = p->acc.mag();
+            if (aOld <= 0) break;
+            if (r <= node->bmax || node->bounds.contains(p->pos)) return false;
+            return k * node->totalMass * s * s <= macTolerance * aOld * powN2(r);
+        }
+        default:
+            break;
+        }
+        return s / r < theta;
+    }
+
+    void computeForceRecursive(QuadNode* node, const Particle* p, double k, double power, WalkResult& w) const {
+        if (!node || node->totalMass <= 0) return;
+        if (split && boxDistance(node->bounds, p->pos) > split->cutoff()) return;
         
         Vec2D<double> rVec = node->centerOfMass - p->pos;
+        if (periodicBox > 0) rVec = minImage(rVec);
         double rSq = rVec.magSq();
         double r = sqrt(rSq);
-        double s = node->bounds.halfDim * 2.0;
 
-        // Barnes-Hut MAC: If far enough (s/d < theta), treat as single body
-        if (node->isLeaf || (s / r < theta)) {
-            if (node->body == p) return Vec2D(0.0,0.0); // Self
-            
-            double dist = max(r, SOFTENING); // 
-            double fMag = (k * p->mass * node->totalMass) / pow(dist, power);
-            return rVec * (fMag / dist);
+        // MAC: If far enough, treat as single body
+        if (node->isLeaf || acceptNode(node, p, r, k, power)) {
+            if (node->body == p) return; // Self
+            accumulatePair(w, rVec, r, p->mass, node->totalMass, k, power, split ? split->shortFactor(r) : 1.0);
+            if (ewald) w.force += ewald->correction(rVec) * (k * p->mass * node->totalMass);
+            return;
         }
 
         // Otherwise, recurse deeper
-        Vec2D totalForce(0.0,0.0);
         for(int i=0; i<4; ++i) {
-            totalForce += computeForceRecursive(node->children[i], p, k, power);
+            computeForceRecursive(node->children[i], p, k, power, w);
+        }
+    }
+
+    template<typename F>
+    void radiusRecursive(const QuadNode* node, const Vec2D<double>& c, double r, F& visit) const {
+        if (!node || node->totalMass <= 0 || boxDistance(node->bounds, c) > r) return;
+        if (node->isLeaf) {
+            if (node->body && (node->body->pos - c).magSq() <= r * r) visit(node->body);
+            return;
         }
-        return totalForce;
+        for (int i = 0; i < 4; ++i) radiusRecursive(node->children[i], c, r, visit);
+    }
+
+    void rangeRecursive(const QuadNode* node, const BoundingBox& box, std::vector<Particle*>& out) const {
+        if (!node || node->totalMass <= 0 || !node->bounds.intersects(box)) return;
+        if (node->isLeaf) {
+            if (node->body && box.contains(node->body->pos)) out.push_back(node->body);
+            return;
+        }
+        for (int i = 0; i < 4; ++i) rangeRecursive(node->children[i], box, out);
+    }
+
+    // best-first descent keeping a max-heap of the k closest (squared distance, body)
+    void nearestRecursive(const QuadNode* node, const Vec2D<double>& c, size_t k, const Particle* exclude,
+                          std::vector<std::pair<double, Particle*>>& heap) const {
+        if (!node || node->totalMass <= 0) return;
+        double d = boxDistance(node->bounds, c);
+        if (heap.size() == k && d * d >= heap.front().first) return;
+        if (node->isLeaf) {
+            if (node->body && node->body != exclude) offerNearest(node->body, c, k, heap);
+            return;
+        }
+        int idx[4] = {0, 1, 2, 3};
+        double dist[4];
+        for (int i = 0; i < 4; ++i) dist[i] = node->children[i] ? boxDistance(node->children[i]->bounds, c) : INFINITY;
+        std::sort(idx, idx + 4, [&](int a, int b) { return dist[a] < dist[b]; });
+        for (int i = 0; i < 4; ++i) nearestRecursive(node->children[idx[i]], c, k, exclude, heap);
+    }
+
+    static void offerNearest(Particle* b, const Vec2D<double>& c, size_t k, std::vector<std::pair<double, Particle*>>& heap) {
+        double d2 = (b->pos - c).magSq();
+        if (heap.size() < k) {
+            heap.push_back({d2, b});
+            std::push_heap(heap.begin(), heap.end());
+        } else if (d2 < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = {d2, b};
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    void collectBodiesRecursive(const QuadNode* node, std::vector<Particle*>& out) const {
+        if (!node) return;
+        if (node->isLeaf) {
+            if (node->body) out.push_back(node->body);
+            return;
+        }
+        for (int i = 0; i < 4; ++i) collectBodiesRecursive(node->children[i], out);
+    }
+
+    int depthRecursive(const QuadNode* node) const {
+        if (!node || node->isLeaf) return 0;
+        int d = 0;
+        for (int i = 0; i < 4; ++i) d = max(d, depthRecursive(node->children[i]));
+        return d + 1;
+    }
+
+    void collectRecursive(const QuadNode* node, int depth, int maxDepth, double minCellSize,
+                          std::vector<NodeAggregate>& out) const {
+        if (!node || node->totalMass <= 0) return;
+        double size = node->bounds.halfDim * 2.0;
+        if (node->isLeaf || depth >= maxDepth || size <= minCellSize) {
+            out.push_back({node->centerOfMass, node->totalMass, node->isLeaf ? 0.0 : size});
+            return;
+        }
+        for (int i = 0; i < 4; ++i) collectRecursive(node->children[i], depth + 1, maxDepth, minCellSize, out);
     }
 
 public:
     // Allocator size = Est. Particles * 2 (for safety)
     BarnesHutTree(size_t maxParticles, double _theta = THETA_DEFAULT) 
-        : allocator(maxParticles * 4), theta(_theta), root(nullptr) {}
+        : root(nullptr), allocator(maxParticles * 4), theta(_theta), bodies(nullptr), periodicBox(0), ewald(nullptr), split(nullptr),
+          mac(OpeningCriterion::GEOMETRIC), macTolerance(0) {}
+
+    // tolerance: absolute acceleration for SALMON_WARREN, the fraction of |acc| for
+    // RELATIVE; GEOMETRIC and OFFSET use theta
+    void setOpeningCriterion(OpeningCriterion c, double tolerance = 0) {
+        if ((c == OpeningCriterion::SALMON_WARREN || c == OpeningCriterion::RELATIVE) && tolerance <= 0)
+            throw invalid_argument("Opening criterion needs a positive tolerance");
+        mac = c;
+        macTolerance = tolerance;
+    }
+
+    // boxSize <= 0 switches back to open boundaries
+    void setPeriodic(double boxSize, const EwaldTable* table) {
+        periodicBox = max(boxSize, 0.0);
+        ewald = (periodicBox > 0 && table && !table->empty()) ? table : nullptr;
+    }
+
+    void build(ParticleVector& particles, BoundingBox worldBounds) {
+        while (true) {
+            try {
+                allocator.reset();
+                outliers.clear();
+                bodies = &particles;
+                root = allocator.allocate();
+                root->init(worldBounds);
+
+                for (auto& p : particles) {
+                    // Bounds check, escapers go to the direct-sum list
+                    if (worldBounds.contains(p.pos)) {
+                        insertRecursive(root, &p);
+                    } else {
+                        outliers.push_back(&p);
+                    }
+                }
+                if (mac == OpeningCriterion::SALMON_WARREN || mac == OpeningCriterion::RELATIVE) computeMoments(root);
+                return;
+            } catch (const std::overflow_error&) {
+                // near-coincident bodies went deeper than the arena allows
+                allocator.grow();
+            }
+        }
+    }
 
-    void build(std::vector<Particle>& particles, BoundingBox worldBounds) {
-        allocator.reset();
-        root = allocator.allocate();
-        root->init(worldBounds);
+    // Incremental edits between builds, for trees whose bodies stay where they were
+    // inserted (StaticField): each touches one root-to-leaf path. They return false
+    // when the edit cannot be done in place and the caller should rebuild instead.
 
-        for (auto& p : particles) {
-            // Bounds check
-            if (worldBounds.contains(p.pos)) {
-                insertRecursive(root, &p);
+    // p must live as long as the tree; false if it lies outside the root box or the
+    // arena is full, in which case the tree is left unusable until the next build
+    bool insert(Particle* p) {
+        if (!root || !root->bounds.contains(p->pos)) return false;
+        try {
+            insertRecursive(root, p);
+        } catch (const std::overflow_error&) {
+            return false;
+        }
+        descend(p);
+        for (size_t i = editPath.size(); i-- > 0;) refreshNode(editPath[i]);
+        return true;
+    }
+
+    bool remove(const Particle* p) {
+        if (!root) return false;
+        if (!root->bounds.contains(p->pos)) {
+            auto it = find(outliers.begin(), outliers.end(), p);
+            if (it == outliers.end()) return false;
+            *it = outliers.back();
+            outliers.pop_back();
+            return true;
+        }
+        QuadNode* leaf = descend(p);
+        if (leaf->body != p) return false;
+        leaf->body = nullptr;
+        leaf->totalMass = 0;
+        leaf->centerOfMass = leaf->bounds.center;
+        for (size_t i = editPath.size(); i-- > 0;) refreshNode(editPath[i]);
+        return true;
+    }
+
+    // the body at from was copied to to (same position), e.g. to fill a removed slot
+    bool relocate(const Particle* from, Particle* to) {
+        if (!root) return false;
+        if (!root->bounds.contains(from->pos)) {
+            auto it = find(outliers.begin(), outliers.end(), from);
+            if (it == outliers.end()) return false;
+            *it = to;
+            return true;
+        }
+        QuadNode* leaf = descend(from);
+        if (leaf->body != from) return false;
+        leaf->body = to;
+        return true;
+    }
+
+    // potential (optional) receives p's potential energy from the same node visits;
+    // NaN in TreePM mode, where the long-range part lives on the mesh.
+    // interactions (optional) receives the number of pair terms evaluated.
+    Vec2D<double> getForceOn(const Particle* p, double k, double power, double* potential = nullptr,
+                             size_t* interactions = nullptr) {
+        WalkResult w;
+        w.wantPotential = potential && !split;
+        if (root->bounds.contains(p->pos)) {
+            computeForceRecursive(root, p, k, power, w);
+        } else if (root->totalMass > 0) {
+            // escaper: whole tree seen as its root monopole
+            Vec2D<double> rVec = root->centerOfMass - p->pos;
+            accumulatePair(w, rVec, rVec.mag(), p->mass, root->totalMass, k, power);
+        }
+        for (const Particle* o : outliers) {
+            if (o == p) continue;
+            Vec2D<double> rVec = o->pos - p->pos;
+            accumulatePair(w, rVec, rVec.mag(), p->mass, o->mass, k, power);
+        }
+        if (potential) *potential = split ? NAN : w.potential;
+        if (interactions) *interactions = w.interactions;
+        return w.force;
+    }
+
+    // Field of this tree on a body that is not one of its own: always walked from the
+    // root, since such bodies routinely sit outside the box (see StaticField)
+    Vec2D<double> getFieldOn(const Particle* p, double k, double power, double* potential = nullptr) const {
+        WalkResult w;
+        w.wantPotential = potential != nullptr;
+        computeForceRecursive(root, p, k, power, w);
+        if (potential) *potential = w.potential;
+        return w.force;
+    }
+
+    // nullptr restores the full-range law
+    void setShortRange(const ForceSplit* s) { split = s; }
+
+    size_t outlierCount() const { return outliers.size(); }
+    // nodes allocated by the last build, their bytes, and its deepest level below the root
+    size_t nodeCount() const { return allocator.used_memory() / sizeof(QuadNode); }
+    size_t memoryUsed() const { return allocator.used_memory(); }
+    int depth() const { return depthRecursive(root); }
+
+    // Spatial queries on the last build (plain distances, also in periodic mode). Results
+    // replace the contents of out, which keeps its capacity between calls.
+    void queryRange(const BoundingBox& box, std::vector<Particle*>& out) const {
+        out.clear();
+        if (!root) return;
+        rangeRecursive(root, box, out);
+        for (Particle* o : outliers) if (box.contains(o->pos)) out.push_back(o);
+    }
+
+    void queryRadius(const Vec2D<double>& center, double radius, std::vector<Particle*>& out) const {
+        out.clear();
+        forEachInRadius(center, radius, [&](Particle* b) { out.push_back(b); });
+    }
+
+    template<typename F>
+    void forEachInRadius(const Vec2D<double>& center, double radius, F visit) const {
+        if (!root) return;
+        radiusRecursive(root, center, radius, visit);
+        for (Particle* o : outliers) if ((o->pos - center).magSq() <= radius * radius) visit(o);
+    }
+
+    // k closest bodies to center as (squared distance, body), nearest first
+    void nearest(const Vec2D<double>& center, size_t k, std::vector<std::pair<double, Particle*>>& out,
+                 const Particle* exclude = nullptr) const {
+        out.clear();
+        if (!root || k == 0) return;
+        for (Particle* o : outliers) if (o != exclude) offerNearest(o, center, k, out);
+        nearestRecursive(root, center, k, exclude, out);
+        std::sort_heap(out.begin(), out.end());
+    }
+
+    // Every pair of bodies closer than radius, each reported once (lower address first).
+    // Bodies are swept in parallel into per-thread buffers, then concatenated.
+    void closePairs(double radius, std::vector<std::pair<Particle*, Particle*>>& out, unsigned threads) {
+        out.clear();
+        if (!root || !bodies) return;
+        threads = max(threads, 1u);
+        if (pairScratch.size() < threads) pairScratch.resize(threads);
+        for (auto& buf : pairScratch) buf.clear();
+        ParticleVector& ps = *bodies;
+        parallel_for(ps.size(), threads, [&](size_t b, size_t e, unsigned t) {
+            auto& buf = pairScratch[t];
+            for (size_t i = b; i < e; ++i) {
+                Particle* p = &ps[i];
+                forEachInRadius(p->pos, radius, [&](Particle* q) { if (q > p) buf.push_back({p, q}); });
             }
+        }, 256);
+        for (const auto& buf : pairScratch) out.insert(out.end(), buf.begin(), buf.end());
+    }
+
+    // Bodies of the last build in tree (depth-first quadrant) order, escapers last
+    void collectBodies(std::vector<Particle*>& out) const {
+        out.clear();
+        if (!root) return;
+        collectBodiesRecursive(root, out);
+        out.insert(out.end(), outliers.begin(), outliers.end());
+    }
+
+    // Aggregates from the last build: a node is emitted whole once it is a leaf, reaches
+    // maxDepth or is no larger than minCellSize. Escapers are appended as single bodies.
+    void collectAggregates(int maxDepth, double minCellSize, std::vector<NodeAggregate>& out) const {
+        out.clear();
+        collectRecursive(root, 0, maxDepth, minCellSize, out);
+        for (const Particle* o : outliers) out.push_back({o->pos, o->mass, 0.0});
+    }
+};
+// Bodies that never move, in a tree of their own that is built once and then only
+// queried, so the per-step rebuild covers the moving bodies alone.
+class StaticField {
+private:
+    ParticleVector bodies;
+    std::unique_ptr<BarnesHutTree> tree;
+    double theta = THETA_DEFAULT;
+    double periodicBox = 0;
+    const EwaldTable* ewald = nullptr;
+
+    void rebuild() {
+        tree.reset();
+        if (bodies.empty()) return;
+        double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+        for (const auto& b : bodies) {
+            minX = min(minX, b.pos.x); maxX = max(maxX, b.pos.x);
+            minY = min(minY, b.pos.y); maxY = max(maxY, b.pos.y);
         }
+        double half = max(max(maxX - minX, maxY - minY) * 0.5 * (1.0 + 1e-6), SOFTENING);
+        // headroom so small batches of add() neither move the bodies nor overflow the arena
+        bodies.reserve(bodies.size() + bodies.size() / 4 + 16);
+        tree = std::make_unique<BarnesHutTree>(bodies.capacity() * 2, theta);
+        tree->setPeriodic(periodicBox, ewald);
+        tree->build(bodies, {Vec2D<double>((minX + maxX) * 0.5, (minY + maxY) * 0.5), half});
     }
-    Vec2D<double> getForceOn(const Particle* p, double k, double power) {
-        return computeForceRecursive(root, p, k, power);
+
+public:
+    void assign(ParticleVector src) {
+        bodies = std::move(src);
+        tree.reset();
+    }
+
+    // Call again after moving the bodies (e.g. wrapping them into a periodic box)
+    void build(double _theta, double _periodicBox = 0, const EwaldTable* _ewald = nullptr) {
+        theta = _theta;
+        periodicBox = _periodicBox;
+        ewald = _ewald;
+        rebuild();
+    }
+
+    // Small batches go into the existing tree in place. A batch large against the field,
+    // one that needs more storage (moving every body) or lands outside the box rebuilds;
+    // either way pointers into getBodies() may change.
+    void add(const ParticleVector& batch) {
+        if (batch.empty()) return;
+        bool inPlace = tree && batch.size() * 4 <= bodies.size() && bodies.size() + batch.size() <= bodies.capacity();
+        size_t start = bodies.size();
+        bodies.insert(bodies.end(), batch.begin(), batch.end());
+        for (size_t i = start; inPlace && i < bodies.size(); ++i) inPlace = tree->insert(&bodies[i]);
+        if (!inPlace) rebuild();
+    }
+
+    // Removes body i; the last body moves into its slot
+    void removeAt(size_t i) {
+        size_t last = bodies.size() - 1;
+        bool inPlace = tree && tree->remove(&bodies[i]) && (i == last || tree->relocate(&bodies[last], &bodies[i]));
+        if (i != last) bodies[i] = bodies[last];
+        bodies.pop_back();
+        if (!inPlace) rebuild();
+    }
+
+    bool empty() const { return bodies.empty(); }
+    size_t size() const { return bodies.size(); }
+    ParticleVector& getBodies() { return bodies; }
+    const ParticleVector& getBodies() const { return bodies; }
+
+    // potential (optional) receives p's energy against the static bodies
+    Vec2D<double> forceOn(const Particle* p, double k, double power, double* potential = nullptr) const {
+        if (!tree) {
+            if (potential) *potential = 0;
+            return Vec2D<double>(0.0, 0.0);
+        }
+        return tree->getFieldOn(p, k, power, potential);
     }
 };
+
 template<typename T>
 class Stack {
 private:
@@ -419,29 +1273,47 @@ private:
     size_t capacity;
     size_t topIndex;
 
-    void resize() {
-        capacity *= 2;
-        T* newArr = new T[capacity];
+    void reallocate(size_t newCap) {
+        T* newArr = new T[newCap];
         for (size_t i = 0; i < topIndex; ++i)
-            newArr[i] = arr[i];
+            newArr[i] = std::move(arr[i]);
         delete[] arr;
         arr = newArr;
+        capacity = newCap;
     }
 
 public:
-    Stack(size_t cap = 10) : capacity(cap), topIndex(0) {
+    Stack(size_t cap = 10) : capacity(max<size_t>(cap, 1)), topIndex(0) {
         arr = new T[capacity];
     }
 
+    Stack(const Stack&) = delete;
+    Stack& operator= (const Stack&) = delete;
+    Stack(Stack&& o) noexcept : arr(o.arr), capacity(o.capacity), topIndex(o.topIndex) {
+        o.arr = nullptr;
+        o.capacity = o.topIndex = 0;
+    }
+    Stack& operator= (Stack&& o) noexcept {
+        swap(arr, o.arr);
+        swap(capacity, o.capacity);
+        swap(topIndex, o.topIndex);
+        return *this;
+    }
+
     ~Stack() {
         delete[] arr;
     }
 
     void push(const T& value) {
         if (topIndex == capacity)
-            resize();
+            reallocate(max<size_t>(capacity * 2, 1));
         arr[topIndex++] = value;
     }
+    void push(T&& value) {
+        if (topIndex == capacity)
+            reallocate(max<size_t>(capacity * 2, 1));
+        arr[topIndex++] = std::move(value);
+    }
 
     void pop() {
         if (empty())
@@ -449,12 +1321,23 @@ public:
         --topIndex;
     }
 
-    T top() const {
+    T& top() {
+        if (empty())
+            throw runtime_error("Stack is empty");
+        return arr[topIndex - 1];
+    }
+    const T& top() const {
         if (empty())
             throw runtime_error("Stack is empty");
         return arr[topIndex - 1];
     }
 
+    void reserve(size_t n) {
+        if (n > capacity) reallocate(n);
+    }
+    // keeps the storage
+    void clear() { topIndex = 0; }
+
     bool empty() const {
         return topIndex == 0;
     }
@@ -465,7 +1348,7 @@ public:
 
     void print() const {
         cout << "Stack (top -> bottom): ";
-        for (int i = topIndex - 1; i >= 0; --i)
+        for (size_t i = topIndex; i-- > 0;)
             cout << arr[i] << " ";
         cout << endl;
     }
@@ -480,38 +1363,61 @@ private:
     size_t rearIndex;
     size_t count;
 
-    void resize() {
-        size_t newCap = capacity * 2;
+    void reallocate(size_t newCap) {
         T* newArr = new T[newCap];
 
         for (size_t i = 0; i < count; ++i)
-            newArr[i] = arr[(frontIndex + i) % capacity];
+            newArr[i] = std::move(arr[(frontIndex + i) % capacity]);
 
         delete[] arr;
         arr = newArr;
         capacity = newCap;
         frontIndex = 0;
-        rearIndex = count;
+        rearIndex = count % capacity;
     }
 
 public:
     Queue(size_t cap = 10)
-        : capacity(cap), frontIndex(0), rearIndex(0), count(0) {
+        : capacity(max<size_t>(cap, 1)), frontIndex(0), rearIndex(0), count(0) {
         arr = new T[capacity];
     }
 
+    Queue(const Queue&) = delete;
+    Queue& operator= (const Queue&) = delete;
+    Queue(Queue&& o) noexcept
+        : arr(o.arr), capacity(o.capacity), frontIndex(o.frontIndex), rearIndex(o.rearIndex), count(o.count) {
+        o.arr = nullptr;
+        o.capacity = o.frontIndex = o.rearIndex = o.count = 0;
+    }
+    Queue& operator= (Queue&& o) noexcept {
+        swap(arr, o.arr);
+        swap(capacity, o.capacity);
+        swap(frontIndex, o.frontIndex);
+        swap(rearIndex, o.rearIndex);
+        swap(count, o.count);
+        return *this;
+    }
+
     ~Queue() {
         delete[] arr;
     }
 
     void enqueue(const T& value) {
         if (count == capacity)
-            resize();
+            reallocate(max<size_t>(capacity * 2, 1));
 
         arr[rearIndex] = value;
         rearIndex = (rearIndex + 1) % capacity;
         ++count;
     }
+    void enqueue(T&& value) {
+        if (count == capacity)
+            reallocate(max<size_t>(capacity * 2, 1));
+
+        arr[rearIndex] = std::move(value);
+        rearIndex = (rearIndex + 1) % capacity;
+        ++count;
+    }
 
     void dequeue() {
         if (empty())
@@ -521,11 +1427,24 @@ public:
         --count;
     }
 
-    T front() const {
+    T& front() {
         if (empty())
             throw runtime_error("Queue is empty");
         return arr[frontIndex];
     }
+    const T& front() const {
+        if (empty())
+            throw runtime_error("Queue is empty");
+        return arr[frontIndex];
+    }
+
+    void reserve(size_t n) {
+        if (n > capacity) reallocate(n);
+    }
+    // keeps the storage
+    void clear() {
+        frontIndex = rearIndex = count = 0;
+    }
 
     bool empty() const {
         return count == 0;
@@ -543,28 +1462,213 @@ public:
     }
 };
 
-template<class It, class Comp>
-void merge_sort(It l, It r, Comp cmp){
+// true on the workers of any ThreadPool, and on a thread while it runs a batch
+// (ThreadPool::run), so nested parallel loops fall back instead of re-entering
+inline bool& insidePool() {
+    thread_local bool inside = false;
+    return inside;
+}
+
+// Fixed set of workers draining a shared job queue. The same workers also run
+// fork-join batches (run), which parallel_for uses so steps do not start threads.
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    Queue<std::function<void()>> jobs;
+    std::mutex m;
+    std::condition_variable jobReady, allDone, batchDone;
+    size_t pending;
+    bool stopping;
+
+    // The current batch, published under m. claim holds the batch's generation in its
+    // high half and the next unclaimed task in its low half, so a worker that wakes
+    // late cannot claim a task of a newer batch with the old function.
+    std::mutex dispatch;  // one batch at a time
+    uint32_t generation;
+    void (*batchFn)(void*, unsigned);
+    void* batchCtx;
+    unsigned batchTasks;
+    std::atomic<uint64_t> claim;
+    std::atomic<unsigned> batchLeft;
+
+    void drain(uint32_t gen, void (*fn)(void*, unsigned), void* ctx, unsigned tasks) {
+        uint64_t v = claim.load();
+        while ((uint32_t)(v >> 32) == gen && (uint32_t)v < tasks) {
+            if (!claim.compare_exchange_weak(v, v + 1)) continue;
+            fn(ctx, (unsigned)(uint32_t)v);
+            if (batchLeft.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(m);
+                batchDone.notify_all();
+            }
+            v = claim.load();
+        }
+    }
+
+    void workerLoop() {
+        insidePool() = true;
+        uint32_t seen;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            seen = generation;
+        }
+        while (true) {
+            std::function<void()> job;
+            void (*fn)(void*, unsigned) = nullptr;
+            void* ctx = nullptr;
+            unsigned tasks = 0;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                jobReady.wait(lock, [&] { return stopping || !jobs.empty() || generation != seen; });
+                if (generation != seen) {
+                    seen = generation;
+                    fn = batchFn;
+                    ctx = batchCtx;
+                    tasks = batchTasks;
+                } else {
+                    if (jobs.empty()) return;
+                    job = std::move(jobs.front());
+                    jobs.dequeue();
+                }
+            }
+            if (fn) {
+                drain(seen, fn, ctx, tasks);
+                continue;
+            }
+            job();
+            std::lock_guard<std::mutex> lock(m);
+            if (--pending == 0) allDone.notify_all();
+        }
+    }
+
+public:
+    ThreadPool(unsigned n = hardwareThreads())
+        : pending(0), stopping(false), generation(0), batchFn(nullptr), batchCtx(nullptr), batchTasks(0),
+          claim(0), batchLeft(0) {
+        for (unsigned i = 0; i < max(n, 1u); ++i) workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            jobs.enqueue(std::move(job));
+            ++pending;
+        }
+        jobReady.notify_one();
+    }
+
+    // blocks until every submitted job has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(m);
+        allDone.wait(lock, [this] { return pending == 0; });
+    }
+
+    // Fork-join: fn(ctx, t) for every t in [0, tasks), on the workers and the calling
+    // thread, which also picks up tasks no idle worker took. Adds workers up to
+    // tasks - 1 on first need; after that a batch does not allocate. Returns false,
+    // having run nothing, while another batch is in flight or when called from a worker
+    // or from inside a batch.
+    bool run(unsigned tasks, void (*fn)(void*, unsigned), void* ctx) {
+        if (insidePool() || !dispatch.try_lock()) return false;
+        std::lock_guard<std::mutex> hold(dispatch, std::adopt_lock);
+        // the caller runs tasks too; a parallel loop inside one must not come back here
+        struct Inside {
+            Inside() { insidePool() = true; }
+            ~Inside() { insidePool() = false; }
+        } inside;
+        while (workers.size() + 1 < tasks) workers.emplace_back(&ThreadPool::workerLoop, this);
+        uint32_t gen;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            gen = ++generation;
+            batchFn = fn;
+            batchCtx = ctx;
+            batchTasks = tasks;
+            batchLeft.store(tasks);
+            claim.store((uint64_t)gen << 32);
+        }
+        jobReady.notify_all();
+        drain(gen, fn, ctx, tasks);
+        std::unique_lock<std::mutex> lock(m);
+        batchDone.wait(lock, [this] { return batchLeft.load() == 0; });
+        return true;
+    }
+
+    size_t size() const { return workers.size(); }
+};
+
+// workers of parallel_for and parallel_zones, started on first use
+inline ThreadPool& sharedPool() {
+    static ThreadPool pool(1);
+    return pool;
+}
+
+inline void forkJoin(unsigned tasks, void (*fn)(void*, unsigned), void* ctx) {
+    if (tasks <= 1) {
+        fn(ctx, 0);
+        return;
+    }
+    if (sharedPool().run(tasks, fn, ctx)) return;
+    // nested in a pool job, or another thread's batch is running: plain threads
+    std::vector<std::thread> extra;
+    extra.reserve(tasks - 1);
+    for (unsigned t = 1; t < tasks; ++t) extra.emplace_back(fn, ctx, t);
+    fn(ctx, 0);
+    for (auto& w : extra) w.join();
+}
+
+// Stable merge sort of [l, r) through buf, which must hold at least r - l elements;
+// short runs use insertion sort. Elements are moved, never copied.
+template<class It, class Comp, class BufIt>
+void merge_sort_with(It l, It r, Comp cmp, BufIt buf){
     auto n = r - l;
-    if(n <= 1) return;
+    if (n <= 16) {
+        for (It i = l + 1; i < r; ++i) {
+            auto v = std::move(*i);
+            It j = i;
+            for (; j > l && cmp(v, *(j - 1)); --j) *j = std::move(*(j - 1));
+            *j = std::move(v);
+        }
+        return;
+    }
 
     It m = l + n/2;
-    merge_sort(l, m, cmp);
-    merge_sort(m, r, cmp);
-
-    using T = typename iterator_traits<It>::value_type;
-    vector<T> tmp;
-    tmp.reserve(n);
+    merge_sort_with(l, m, cmp, buf);
+    merge_sort_with(m, r, cmp, buf);
+    if (!cmp(*m, *(m - 1))) return; // halves already in order
 
+    BufIt out = buf;
     It i = l, j = m;
     while(i < m && j < r){
-        if(cmp(*j, *i)) tmp.push_back(*j++);
-        else tmp.push_back(*i++);
+        if(cmp(*j, *i)) *out++ = std::move(*j++);
+        else *out++ = std::move(*i++);
     }
-    while(i < m) tmp.push_back(*i++);
-    while(j < r) tmp.push_back(*j++);
+    while(i < m) *out++ = std::move(*i++);
+    while(j < r) *out++ = std::move(*j++);
 
-    for (int k = 0; k<n; k++) *(l + k) = tmp[k];
+    std::move(buf, buf + n, l);
+}
+
+// scratch grows to the input size and is kept by the caller, so repeated sorts do not allocate
+template<class It, class Comp, class Buffer>
+void merge_sort(It l, It r, Comp cmp, Buffer& scratch){
+    if (scratch.size() < (size_t)(r - l)) scratch.resize(r - l);
+    merge_sort_with(l, r, cmp, scratch.begin());
+}
+
+template<class It, class Comp>
+void merge_sort(It l, It r, Comp cmp){
+    using T = typename iterator_traits<It>::value_type;
+    vector<T> scratch;
+    merge_sort(l, r, cmp, scratch);
 }
 // Add this inside namespace ds in ds.hpp
 
@@ -574,41 +1678,87 @@ private:
     struct Entry {
         K key;
         V value;
-        bool operator==(const Entry& other) const { return key == other.key; }
-        friend ostream& operator<<(ostream& os, const Entry& e) { return os; } 
+        bool used;
     };
 
-    // created a simple hash table with separate chaining using SList
-    SList<Entry>* table;
-    size_t capacity;
+    // open addressing with linear probing, at most half full; erase shifts the rest of
+    // the probe run back instead of leaving tombstones, so lookups stay O(1)
+    std::vector<Entry> table;
+    size_t count;
+    size_t mask;
+
+    size_t slotOf(K key) const { return (size_t)splitmix64((uint64_t)key) & mask; }
 
-    size_t hash(int key) const {
-        return key % capacity; 
+    size_t probe(K key) const {
+        size_t i = slotOf(key);
+        while (table[i].used && !(table[i].key == key)) i = (i + 1) & mask;
+        return i;
     }
 
-public:
-    HashTable(size_t cap = 100) : capacity(cap) {
-        table = new SList<Entry>[capacity];
+    void rehash(size_t cap) {
+        std::vector<Entry> old;
+        old.swap(table);
+        table.assign(cap, Entry{K(), V(), false});
+        mask = cap - 1;
+        for (const Entry& e : old) {
+            if (e.used) table[probe(e.key)] = e;
+        }
     }
 
-    ~HashTable() {
-        delete[] table;
+public:
+    HashTable(size_t cap = 100) : count(0) {
+        size_t c = 16;
+        while (c < cap * 2) c <<= 1;
+        table.assign(c, Entry{K(), V(), false});
+        mask = c - 1;
     }
 
+    // inserts, or overwrites the value already stored under key
     void insert(K key, V value) {
-        size_t index = hash(key);
-        table[index].push_back({key, value});
+        if ((count + 1) * 2 > table.size()) rehash(table.size() * 2);
+        size_t i = probe(key);
+        if (!table[i].used) ++count;
+        table[i] = {key, value, true};
+    }
+
+    V search(K key) const {
+        size_t i = probe(key);
+        if (!table[i].used) throw runtime_error("Key not found");
+        return table[i].value;
+    }
+
+    // nullptr if absent
+    V* find(K key) {
+        size_t i = probe(key);
+        return table[i].used ? &table[i].value : nullptr;
+    }
+    const V* find(K key) const {
+        size_t i = probe(key);
+        return table[i].used ? &table[i].value : nullptr;
+    }
+
+    bool erase(K key) {
+        size_t i = probe(key);
+        if (!table[i].used) return false;
+        for (size_t j = (i + 1) & mask; table[j].used; j = (j + 1) & mask) {
+            // the entry at j may fill the hole at i unless its home slot lies in (i, j]
+            size_t home = slotOf(table[j].key);
+            bool stays = (i < j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays) {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i].used = false;
+        --count;
+        return true;
     }
 
-    V search(K key) {
-        size_t index = hash(key);
-        // list traverses manually to find key
-        
-        for(size_t i = 0; i < table[index].length(); i++) {
-            Entry e = table[index].get(i);
-            if(e.key == key) return e.value;
-        }// exception if not found
-        throw runtime_error("Key not found");
+    size_t size() const { return count; }
+
+    void clear() {
+        for (Entry& e : table) e.used = false;
+        count = 0;
     }
 };
 }
@@ -0,0 +1,208 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <stdexcept>
+#include "ds.hpp"
+
+using namespace std;
+
+namespace ds {
+
+// Binary input: BINARY_MAGIC, uint64 count, then count records of 5 doubles.
+constexpr char BINARY_MAGIC[4] = {'N', 'B', 'D', '1'};
+
+enum class Distribution { UNIFORM, PLUMMER, DISK, CLUSTERS, LATTICE };
+
+struct BodyRecord {
+    double x, y, m, vx, vy;
+};
+
+struct GeneratorConfig {
+    Distribution dist = Distribution::UNIFORM;
+    size_t n = 1000;
+    uint64_t seed = 1;
+    double bound = 100.0;     // half-width of the box, or the scale radius
+    double massLow = 50;
+    double massHigh = 200;
+    double vLim = 1;
+    int clusters = 8;
+};
+
+// Counter-based stream: the i-th body's numbers depend only on (seed, i), so the
+// output is identical whatever the thread count or chunking.
+class CounterRng {
+private:
+    uint64_t key;
+    uint64_t counter;
+
+public:
+    CounterRng(uint64_t seed, uint64_t stream) : key(splitmix64(seed ^ splitmix64(stream))), counter(0) {}
+
+    uint64_t next() { return splitmix64(key + 0x632be59bd9b4e019ULL * ++counter); }
+    // (0, 1]
+    double uniform() { return ((next() >> 11) + 1) * 0x1.0p-53; }
+    double uniform(double lo, double hi) { return lo + (hi - lo) * uniform(); }
+    double gaussian() {
+        return sqrt(-2.0 * log(uniform())) * cos(2 * M_PI * uniform());
+    }
+};
+
+inline Distribution parseDistribution(const string& name) {
+    if (name == "uniform") return Distribution::UNIFORM;
+    if (name == "plummer") return Distribution::PLUMMER;
+    if (name == "disk") return Distribution::DISK;
+    if (name == "clusters") return Distribution::CLUSTERS;
+    if (name == "lattice") return Distribution::LATTICE;
+    throw invalid_argument("Unknown distribution: " + name);
+}
+
+inline BodyRecord generateBody(const GeneratorConfig& cfg, size_t i) {
+    CounterRng rng(cfg.seed, i);
+    BodyRecord b{0, 0, rng.uniform(cfg.massLow, cfg.massHigh), 0, 0};
+    double a = cfg.bound;
+
+    switch (cfg.dist) {
+    case Distribution::UNIFORM:
+        b.x = rng.uniform(-a, a);
+        b.y = rng.uniform(-a, a);
+        // same 10% drifters as the original generator, everything else at rest
+        if (rng.uniform() > 0.9) b.vx = rng.uniform() * cfg.vLim;
+        if (rng.uniform() > 0.9) b.vy = rng.uniform() * cfg.vLim;
+        break;
+    case Distribution::PLUMMER: {
+        // surface density ~ (1 + R^2/s^2)^-2 with scale s = a/4, M(<R) = R^2 / (R^2 + s^2)
+        double s = a / 4, u = min(rng.uniform(), 0.999);
+        double r = s * sqrt(u / (1 - u)), phi = rng.uniform(0, 2 * M_PI);
+        b.x = r * cos(phi);
+        b.y = r * sin(phi);
+        b.vx = rng.gaussian() * cfg.vLim * 0.5;
+        b.vy = rng.gaussian() * cfg.vLim * 0.5;
+        break;
+    }
+    case Distribution::DISK: {
+        // exponential surface density with scale length a/4 (radius ~ Gamma(2)), rotating
+        double rd = a / 4;
+        double r = -rd * log(rng.uniform() * rng.uniform()), phi = rng.uniform(0, 2 * M_PI);
+        double vc = cfg.vLim * r / (r + rd);
+        b.x = r * cos(phi);
+        b.y = r * sin(phi);
+        b.vx = -vc * sin(phi);
+        b.vy = vc * cos(phi);
+        break;
+    }
+    case Distribution::CLUSTERS: {
+        int c = (int)(rng.next() % (uint64_t)max(cfg.clusters, 1));
+        CounterRng centre(cfg.seed ^ 0xc1u, (uint64_t)c);
+        double cx = centre.uniform(-a, a), cy = centre.uniform(-a, a);
+        double sigma = a * centre.uniform(0.02, 0.1);
+        b.x = cx + rng.gaussian() * sigma;
+        b.y = cy + rng.gaussian() * sigma;
+        break;
+    }
+    case Distribution::LATTICE: {
+        size_t side = (size_t)ceil(sqrt((double)max<size_t>(cfg.n, 1)));
+        double spacing = 2 * a / side;
+        b.x = -a + spacing * (i % side + 0.5);
+        b.y = -a + spacing * (i / side + 0.5);
+        break;
+    }
+    }
+    return b;
+}
+
+inline void generateRange(const GeneratorConfig& cfg, size_t begin, size_t end, BodyRecord* out, unsigned threads) {
+    parallel_for(end - begin, threads, [&](size_t b, size_t e, unsigned) {
+        for (size_t i = b; i < e; ++i) out[i] = generateBody(cfg, begin + i);
+    });
+}
+
+inline ParticleVector generateParticles(const GeneratorConfig& cfg, unsigned threads = hardwareThreads()) {
+    vector<BodyRecord> bodies(cfg.n);
+    generateRange(cfg, 0, cfg.n, bodies.data(), threads);
+    ParticleVector ps(cfg.n);
+    parallel_for(cfg.n, threads, [&](size_t b, size_t e, unsigned) {
+        for (size_t i = b; i < e; ++i) {
+            ps[i].id = i;
+            ps[i].pos = {bodies[i].x, bodies[i].y};
+            ps[i].mass = bodies[i].m;
+            ps[i].vel = {bodies[i].vx, bodies[i].vy};
+        }
+    });
+    return ps;
+}
+
+inline bool isBinaryBodyFile(const string& filename) {
+    ifstream in(filename, ios::binary);
+    char magic[4];
+    return in.read(magic, 4) && memcmp(magic, BINARY_MAGIC, 4) == 0;
+}
+
+inline vector<BodyRecord> readBinaryBodies(const string& filename) {
+    ifstream in(filename, ios::binary);
+    char magic[4];
+    uint64_t count = 0;
+    if (!in.read(magic, 4) || memcmp(magic, BINARY_MAGIC, 4) != 0 || !in.read((char*)&count, sizeof(count)))
+        throw runtime_error("Not a binary body file: " + filename);
+    // check the header count against the file before sizing anything by it
+    auto header = in.tellg();
+    in.seekg(0, ios::end);
+    uint64_t remaining = (uint64_t)(in.tellg() - header);
+    in.seekg(header);
+    if (count > remaining / sizeof(BodyRecord))
+        throw runtime_error("Truncated binary body file: " + filename);
+    vector<BodyRecord> bodies(count);
+    if (!in.read((char*)bodies.data(), count * sizeof(BodyRecord)))
+        throw runtime_error("Truncated binary body file: " + filename);
+    return bodies;
+}
+
+// Streams the bodies in blocks: each block is generated (and formatted, for text) in
+// parallel, then written in order. Files ending in ".bin" get the binary format.
+inline void writeBodies(const GeneratorConfig& cfg, const string& filename, unsigned threads = hardwareThreads()) {
+    bool binary = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".bin") == 0;
+    ofstream out(filename, ios::binary);
+    if (!out.is_open()) throw runtime_error("Could not open " + filename);
+
+    if (binary) {
+        uint64_t count = cfg.n;
+        out.write(BINARY_MAGIC, 4);
+        out.write((const char*)&count, sizeof(count));
+    }
+
+    const size_t BLOCK = 1 << 20;
+    vector<BodyRecord> block(min(cfg.n, BLOCK));
+    vector<string> text(max(threads, 1u));
+    for (size_t begin = 0; begin < cfg.n; begin += BLOCK) {
+        size_t end = min(cfg.n, begin + BLOCK), len = end - begin;
+        generateRange(cfg, begin, end, block.data(), threads);
+        if (binary) {
+            out.write((const char*)block.data(), len * sizeof(BodyRecord));
+            continue;
+        }
+
+        // same "x,y,m,vx,vy" lines as before (10 significant digits), formatted per thread
+        size_t chunk = (len + text.size() - 1) / text.size();
+        parallel_for(text.size(), threads, [&](size_t tb, size_t te, unsigned) {
+            for (size_t t = tb; t < te; ++t) {
+                string& s = text[t];
+                s.clear();
+                char buf[32];
+                for (size_t i = t * chunk; i < min(len, (t + 1) * chunk); ++i) {
+                    const double vals[5] = {block[i].x, block[i].y, block[i].m, block[i].vx, block[i].vy};
+                    for (int v = 0; v < 5; ++v) {
+                        auto res = to_chars(buf, buf + sizeof(buf), vals[v], chars_format::general, 10);
+                        s.append(buf, res.ptr);
+                        s.push_back(v < 4 ? ',' : '\n');
+                    }
+                }
+            }
+        }, 1);
+        for (const string& s : text) out.write(s.data(), s.size());
+    }
+}
+
+}
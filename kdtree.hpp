@@ -0,0 +1,626 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include "ds.hpp"
+
+using namespace std;
+
+namespace ds {
+
+constexpr size_t KD_LEAF_SIZE = 8;
+
+// Where a k-d node cuts its bodies along the longer side of its box:
+//   MEDIAN  equal body counts on both sides
+//   MASS    equal mass on both sides, kept within the middle half of the bodies so a few
+//           heavy bodies cannot make the tree deep
+enum class KdSplit { MEDIAN, MASS };
+
+// Binary alternative to BarnesHutTree (TreeType::KD_TREE). Every node cuts its bodies at
+// the median along the longer side of their tight bounding box, so the depth is about
+// log2(N / leafSize) whatever the shape of the input: a thin disk or a filament gets no
+// deeper a tree than a uniform square, and there are no empty siblings. Leaves hold up to
+// leafSize bodies, summed directly. Opening tests use the tight box, which for elongated
+// clumps is far smaller than the enclosing quadrant. Simulation drives it through the same
+// calls as the quadtree.
+class KdTree {
+public:
+    // tags a node in an interaction list; untagged entries are bodies
+    static constexpr uint32_t NODE_ENTRY = 0x80000000u;
+    // one term of an interaction list: a node, usable while its drift stays within limit,
+    // or a body
+    struct ListEntry {
+        uint32_t index;
+        float limit;
+    };
+
+private:
+    struct Node {
+        double minX = 0, minY = 0, maxX = 0, maxY = 0;   // tight box of the bodies below
+        double totalMass = 0;
+        Vec2D<double> centerOfMass;
+        // as in QuadNode, filled only for the criteria using them
+        double bmax = 0;
+        double quadMoment = 0;
+        uint32_t begin = 0, end = 0;   // bodies order[begin, end)
+        uint32_t child = 0;            // children child and child + 1, 0 for a leaf
+
+        bool isLeaf() const { return child == 0; }
+        double size() const { return max(maxX - minX, maxY - minY); }
+        Vec2D<double> center() const { return Vec2D<double>((minX + maxX) * 0.5, (minY + maxY) * 0.5); }
+        bool contains(const Vec2D<double>& p) const { return p.x >= minX && p.x <= maxX && p.y >= minY && p.y <= maxY; }
+    };
+
+    std::vector<Node> nodes;        // nodes[0] is the root, children always after their parent
+    std::vector<float> drift;       // per node: furthest any of its bodies is from its build position
+    std::vector<Particle*> order;   // bodies in tree order, each node a contiguous range
+    std::vector<Particle*> outliers;
+    ParticleVector* bodies;
+    BoundingBox world;    // box of the last build, bodies outside it are outliers
+    std::vector<std::vector<std::pair<Particle*, Particle*>>> pairScratch;
+    double theta;
+    KdSplit rule;
+    size_t leafSize;
+    int maxDepth;
+    double periodicBox;
+    const EwaldTable* ewald;
+    const ForceSplit* split;
+    OpeningCriterion mac;
+    double macTolerance;
+
+    static double boxDistance(const Node& n, const Vec2D<double>& p) {
+        double dx = max(max(n.minX - p.x, p.x - n.maxX), 0.0);
+        double dy = max(max(n.minY - p.y, p.y - n.maxY), 0.0);
+        return sqrt(dx * dx + dy * dy);
+    }
+
+    Vec2D<double> minImage(Vec2D<double> d) const {
+        double h = periodicBox * 0.5;
+        if (d.x > h) d.x -= periodicBox; else if (d.x < -h) d.x += periodicBox;
+        if (d.y > h) d.y -= periodicBox; else if (d.y < -h) d.y += periodicBox;
+        return d;
+    }
+
+    bool usesMoments() const { return mac == OpeningCriterion::SALMON_WARREN || mac == OpeningCriterion::RELATIVE; }
+
+    // cut of order[b, e) along axis (0 = x): bodies before the returned index are not
+    // further along the axis than those after it
+    size_t splitPoint(size_t b, size_t e, int axis, double mass) {
+        auto less = [axis](const Particle* x, const Particle* y) {
+            return axis == 0 ? x->pos.x < y->pos.x : x->pos.y < y->pos.y;
+        };
+        auto first = order.begin();
+        size_t n = e - b;
+        if (rule == KdSplit::MEDIAN) {
+            size_t m = b + n / 2;
+            nth_element(first + b, first + m, first + e, less);
+            return m;
+        }
+        // weighted quickselect inside the middle half: [b, lo) stays lighter than half the mass
+        size_t lo = b + n / 4, hi = e - n / 4;
+        nth_element(first + b, first + lo, first + e, less);
+        nth_element(first + lo, first + hi, first + e, less);
+        double below = 0;
+        for (size_t i = b; i < lo; ++i) below += order[i]->mass;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            nth_element(first + lo, first + mid, first + hi, less);
+            double left = 0;
+            for (size_t i = lo; i < mid; ++i) left += order[i]->mass;
+            if (below + left >= mass * 0.5) hi = mid;
+            else { below += left; lo = mid; }
+        }
+        return min(max(hi, b + 1), e - 1);
+    }
+
+    // box, mass and CoM of nd from its bodies
+    void fitBodies(Node& nd) const {
+        nd.minX = nd.minY = INFINITY;
+        nd.maxX = nd.maxY = -INFINITY;
+        nd.totalMass = 0;
+        Vec2D<double> weighted(0.0, 0.0);
+        for (uint32_t i = nd.begin; i < nd.end; ++i) {
+            const Particle* p = order[i];
+            nd.minX = min(nd.minX, p->pos.x); nd.maxX = max(nd.maxX, p->pos.x);
+            nd.minY = min(nd.minY, p->pos.y); nd.maxY = max(nd.maxY, p->pos.y);
+            nd.totalMass += p->mass;
+            weighted += p->pos * p->mass;
+        }
+        if (nd.begin == nd.end) nd.minX = nd.minY = nd.maxX = nd.maxY = 0;
+        nd.centerOfMass = nd.totalMass > 0 ? weighted * (1.0 / nd.totalMass) : nd.center();
+    }
+
+    // bmax and quadMoment, from the bodies for a leaf and the children otherwise
+    void fitMoments(Node& nd) const {
+        nd.bmax = 0;
+        nd.quadMoment = 0;
+        if (nd.isLeaf()) {
+            for (uint32_t i = nd.begin; i < nd.end; ++i) {
+                double d = (order[i]->pos - nd.centerOfMass).mag();
+                nd.bmax = max(nd.bmax, d);
+                nd.quadMoment += order[i]->mass * d * d;
+            }
+            return;
+        }
+        for (uint32_t c = nd.child; c <= nd.child + 1; ++c) {
+            const Node& ch = nodes[c];
+            if (ch.totalMass <= 0) continue;
+            double d = (ch.centerOfMass - nd.centerOfMass).mag();
+            nd.bmax = max(nd.bmax, d + ch.bmax);
+            nd.quadMoment += ch.quadMoment + ch.totalMass * d * d;
+        }
+    }
+
+    // nodes[idx] over order[b, e); appends the children, so no reference survives the recursion
+    void buildNode(uint32_t idx, size_t b, size_t e, int depth) {
+        Node nd;
+        nd.begin = (uint32_t)b;
+        nd.end = (uint32_t)e;
+        fitBodies(nd);
+        maxDepth = max(maxDepth, depth);
+
+        if (e - b <= leafSize) {
+            if (usesMoments()) fitMoments(nd);
+            nodes[idx] = nd;
+            return;
+        }
+
+        int axis = (nd.maxX - nd.minX >= nd.maxY - nd.minY) ? 0 : 1;
+        size_t m = splitPoint(b, e, axis, nd.totalMass);
+        nd.child = (uint32_t)nodes.size();
+        nodes[idx] = nd;
+        nodes.emplace_back();
+        nodes.emplace_back();
+        buildNode(nd.child, b, m, depth + 1);
+        buildNode(nd.child + 1, m, e, depth + 1);
+        if (usesMoments()) fitMoments(nodes[idx]);
+    }
+
+    // as BarnesHutTree::acceptNode with s the longer side of the tight box; a node whose
+    // box holds p is always opened. For cached lists it decides for the worst case of p
+    // moving selfSlack and the node's bodies nodeSlack further: r shrinks by both, s and
+    // bmax grow by 2 nodeSlack.
+    bool acceptNode(const Node& node, const Particle* p, double r, double k, double power,
+                    double selfSlack = 0, double nodeSlack = 0) const {
+        double slack = selfSlack + nodeSlack;
+        if (slack > 0 ? boxDistance(node, p->pos) <= slack : node.contains(p->pos)) return false;
+        double s = node.size() + 2.0 * nodeSlack;
+        r -= slack;
+        double bmax = node.bmax + 2.0 * nodeSlack;
+        auto powN2 = [power](double x) { return power == 2.0 ? (x * x) * (x * x) : pow(x, power + 2.0); };
+        switch (mac) {
+        case OpeningCriterion::OFFSET:
+            return r * theta > s + theta * (node.centerOfMass - node.center()).mag();
+        case OpeningCriterion::SALMON_WARREN: {
+            if (r <= bmax) return false;
+            double c = (power + 1.0) * (power + 2.0) / 4.0;
+            return k * c * node.quadMoment <= macTolerance * powN2(r - bmax);
+        }
+        case OpeningCriterion::RELATIVE: {
+            double aOld = p->acc.mag();
+            if (aOld <= 0) break;
+            if (r <= bmax) return false;
+            return k * node.totalMass * s * s <= macTolerance * aOld * powN2(r);
+        }
+        default:
+            break;
+        }
+        return s / r < theta;
+    }
+
+    void pairTerm(const Particle* p, const Vec2D<double>& rVec, double mass, double k, double power, WalkResult& w) const {
+        double r = rVec.mag();
+        accumulatePair(w, rVec, r, p->mass, mass, k, power, split ? split->shortFactor(r) : 1.0);
+        if (ewald) w.force += ewald->correction(rVec) * (k * p->mass * mass);
+    }
+
+    void computeForceRecursive(uint32_t idx, const Particle* p, double k, double power, WalkResult& w) const {
+        const Node& n = nodes[idx];
+        if (n.totalMass <= 0) return;
+        if (split && boxDistance(n, p->pos) > split->cutoff()) return;
+
+        if (n.end - n.begin > 1) {
+            Vec2D<double> rVec = n.centerOfMass - p->pos;
+            if (periodicBox > 0) rVec = minImage(rVec);
+            if (acceptNode(n, p, rVec.mag(), k, power)) {
+                pairTerm(p, rVec, n.totalMass, k, power, w);
+                return;
+            }
+        }
+        if (n.isLeaf()) {
+            for (uint32_t i = n.begin; i < n.end; ++i) {
+                const Particle* b = order[i];
+                if (b == p) continue;
+                Vec2D<double> rVec = b->pos - p->pos;
+                if (periodicBox > 0) rVec = minImage(rVec);
+                pairTerm(p, rVec, b->mass, k, power, w);
+            }
+            return;
+        }
+        computeForceRecursive(n.child, p, k, power, w);
+        computeForceRecursive(n.child + 1, p, k, power, w);
+    }
+
+    // computeForceRecursive, but writing the terms to list instead of summing them:
+    // How far the node's bodies may move with p moving skin before the node would be
+    // opened, capped at 64 skin; below skin the node is not accepted for a list
+    double nodeAllowance(const Node& n, const Particle* p, double r, double k, double power, double skin) const {
+        double cap = 64.0 * skin;
+        if (mac == OpeningCriterion::GEOMETRIC) {
+            // (s + 2a) / (r - skin - a) < theta, and p stays outside the grown box
+            double a = (theta * (r - skin) - n.size()) / (2.0 + theta);
+            return min(min(a, boxDistance(n, p->pos) - skin) * (1.0 - 1e-9), cap);
+        }
+        if (!acceptNode(n, p, r, k, power, skin, skin)) return 0.0;
+        double a = skin;
+        while (a < cap && acceptNode(n, p, r, k, power, skin, 2.0 * a)) a *= 2.0;
+        return a;
+    }
+
+    // accepted nodes with the drift they may reach, single bodies by their index in base.
+    // A node needs room for skin of motion on both sides; far nodes get a larger allowance,
+    // doubled while the test still passes, so a few fast bodies do not expire every list.
+    void recordRecursive(uint32_t idx, const Particle* p, double k, double power, double skin, const Particle* base,
+                         std::vector<ListEntry>& list, WalkResult& w) const {
+        const Node& n = nodes[idx];
+        if (n.totalMass <= 0) return;
+        if (n.end - n.begin > 1) {
+            double r = (n.centerOfMass - p->pos).mag();
+            double allowance = nodeAllowance(n, p, r, k, power, skin);
+            if (allowance >= skin) {
+                list.push_back({NODE_ENTRY | idx, drift[idx] + (float)allowance});
+                pairTerm(p, n.centerOfMass - p->pos, n.totalMass, k, power, w);
+                return;
+            }
+        }
+        if (n.isLeaf()) {
+            for (uint32_t i = n.begin; i < n.end; ++i) {
+                if (order[i] == p) continue;
+                list.push_back({(uint32_t)(order[i] - base), 0.0f});
+                pairTerm(p, order[i]->pos - p->pos, order[i]->mass, k, power, w);
+            }
+            return;
+        }
+        recordRecursive(n.child, p, k, power, skin, base, list, w);
+        recordRecursive(n.child + 1, p, k, power, skin, base, list, w);
+    }
+
+    // adds the escapers and reports the walk; potential is NaN in TreePM mode, as in the quadtree
+    Vec2D<double> finishWalk(const Particle* p, double k, double power, WalkResult& w,
+                             double* potential, size_t* interactions) const {
+        for (const Particle* o : outliers) {
+            if (o == p) continue;
+            Vec2D<double> rVec = o->pos - p->pos;
+            accumulatePair(w, rVec, rVec.mag(), p->mass, o->mass, k, power);
+        }
+        if (potential) *potential = split ? NAN : w.potential;
+        if (interactions) *interactions = w.interactions;
+        return w.force;
+    }
+
+    template<typename F>
+    void radiusRecursive(uint32_t idx, const Vec2D<double>& c, double r, F& visit) const {
+        const Node& n = nodes[idx];
+        if (n.begin == n.end || boxDistance(n, c) > r) return;
+        if (n.isLeaf()) {
+            for (uint32_t i = n.begin; i < n.end; ++i) {
+                if ((order[i]->pos - c).magSq() <= r * r) visit(order[i]);
+            }
+            return;
+        }
+        radiusRecursive(n.child, c, r, visit);
+        radiusRecursive(n.child + 1, c, r, visit);
+    }
+
+    void collectRecursive(uint32_t idx, int depth, int maxLevel, double minCellSize, std::vector<NodeAggregate>& out) const {
+        const Node& n = nodes[idx];
+        if (n.totalMass <= 0) return;
+        if (depth >= maxLevel || n.size() <= minCellSize) {
+            out.push_back({n.centerOfMass, n.totalMass, n.end - n.begin > 1 ? n.size() : 0.0});
+            return;
+        }
+        if (n.isLeaf()) {
+            for (uint32_t i = n.begin; i < n.end; ++i) out.push_back({order[i]->pos, order[i]->mass, 0.0});
+            return;
+        }
+        collectRecursive(n.child, depth + 1, maxLevel, minCellSize, out);
+        collectRecursive(n.child + 1, depth + 1, maxLevel, minCellSize, out);
+    }
+
+public:
+    KdTree(double _theta = THETA_DEFAULT, KdSplit _rule = KdSplit::MEDIAN, size_t _leafSize = KD_LEAF_SIZE)
+        : bodies(nullptr), world{Vec2D<double>(0.0, 0.0), 0.0}, theta(_theta), rule(_rule),
+          leafSize(max<size_t>(_leafSize, 1)), maxDepth(0), periodicBox(0), ewald(nullptr), split(nullptr),
+          mac(OpeningCriterion::GEOMETRIC), macTolerance(0) {}
+
+    void setOpeningCriterion(OpeningCriterion c, double tolerance = 0) {
+        if ((c == OpeningCriterion::SALMON_WARREN || c == OpeningCriterion::RELATIVE) && tolerance <= 0)
+            throw invalid_argument("Opening criterion needs a positive tolerance");
+        mac = c;
+        macTolerance = tolerance;
+    }
+
+    void setPeriodic(double boxSize, const EwaldTable* table) {
+        periodicBox = max(boxSize, 0.0);
+        ewald = (periodicBox > 0 && table && !table->empty()) ? table : nullptr;
+    }
+
+    void setShortRange(const ForceSplit* s) { split = s; }
+
+    // Bodies outside worldBounds are escapers summed directly, as in the quadtree; the
+    // nodes themselves only use the tight boxes. Storage is kept between builds.
+    void build(ParticleVector& particles, BoundingBox worldBounds) {
+        if (particles.size() >= UINT32_MAX) throw overflow_error("KdTree: too many bodies");
+        bodies = &particles;
+        world = worldBounds;
+        order.clear();
+        outliers.clear();
+        for (auto& p : particles) {
+            if (worldBounds.contains(p.pos)) order.push_back(&p);
+            else outliers.push_back(&p);
+        }
+        nodes.clear();
+        nodes.reserve(4 * order.size() / leafSize + 1);
+        nodes.emplace_back();
+        maxDepth = 0;
+        buildNode(0, 0, order.size(), 0);
+        drift.assign(nodes.size(), 0.0f);
+    }
+
+    // Recomputes every node's box and aggregates from the bodies' current positions,
+    // keeping the structure of the last build. The bodies must not have been reordered.
+    void refit() {
+        for (size_t i = nodes.size(); i-- > 0;) {
+            Node& nd = nodes[i];
+            if (nd.isLeaf()) {
+                fitBodies(nd);
+            } else {
+                const Node& a = nodes[nd.child];
+                const Node& b = nodes[nd.child + 1];
+                nd.minX = min(a.minX, b.minX); nd.maxX = max(a.maxX, b.maxX);
+                nd.minY = min(a.minY, b.minY); nd.maxY = max(a.maxY, b.maxY);
+                nd.totalMass = a.totalMass + b.totalMass;
+                nd.centerOfMass = nd.totalMass > 0
+                    ? (a.centerOfMass * a.totalMass + b.centerOfMass * b.totalMass) * (1.0 / nd.totalMass) : nd.center();
+            }
+            if (usesMoments()) fitMoments(nd);
+        }
+    }
+
+    // Node drifts from bodyDrift[body - base], each body's distance from its position at the build
+    void measureDrift(const std::vector<float>& bodyDrift, const Particle* base) {
+        for (size_t i = nodes.size(); i-- > 0;) {
+            const Node& nd = nodes[i];
+            float d = 0;
+            if (nd.isLeaf()) {
+                for (uint32_t j = nd.begin; j < nd.end; ++j) d = max(d, bodyDrift[order[j] - base]);
+            } else {
+                d = max(drift[nd.child], drift[nd.child + 1]);
+            }
+            drift[i] = d;
+        }
+    }
+
+    // Walks for p, a body of base, with the acceptance slack of skin (see acceptNode):
+    // returns the force as evaluateList would and leaves the terms in list. Escapers are
+    // summed but not listed.
+    Vec2D<double> recordList(const Particle* p, double k, double power, double skin, const Particle* base,
+                             std::vector<ListEntry>& list, double* potential = nullptr, size_t* interactions = nullptr) const {
+        WalkResult w;
+        w.wantPotential = potential != nullptr;
+        list.clear();
+        if (!nodes.empty()) recordRecursive(0, p, k, power, skin, base, list, w);
+        return finishWalk(p, k, power, w, potential, interactions);
+    }
+
+    // false once a node on the list drifted past its limit
+    bool listValid(const std::vector<ListEntry>& list) const {
+        for (const ListEntry& e : list) {
+            if ((e.index & NODE_ENTRY) && drift[e.index & ~NODE_ENTRY] > e.limit) return false;
+        }
+        return true;
+    }
+
+    // getForceOn over a recorded list, with the current aggregates and positions
+    Vec2D<double> evaluateList(const Particle* p, const std::vector<ListEntry>& list, const Particle* base,
+                               double k, double power, double* potential = nullptr, size_t* interactions = nullptr) const {
+        WalkResult w;
+        w.wantPotential = potential != nullptr;
+        for (const ListEntry& e : list) {
+            if (e.index & NODE_ENTRY) {
+                const Node& n = nodes[e.index & ~NODE_ENTRY];
+                pairTerm(p, n.centerOfMass - p->pos, n.totalMass, k, power, w);
+            } else {
+                const Particle& b = base[e.index];
+                pairTerm(p, b.pos - p->pos, b.mass, k, power, w);
+            }
+        }
+        return finishWalk(p, k, power, w, potential, interactions);
+    }
+
+    Vec2D<double> getForceOn(const Particle* p, double k, double power, double* potential = nullptr,
+                             size_t* interactions = nullptr) const {
+        WalkResult w;
+        w.wantPotential = potential && !split;
+        if (split && !world.contains(p->pos)) {
+            // escapers are not on the mesh: the whole tree as its root monopole with the
+            // full law, as in the quadtree
+            if (!nodes.empty() && nodes[0].totalMass > 0) {
+                Vec2D<double> rVec = nodes[0].centerOfMass - p->pos;
+                accumulatePair(w, rVec, rVec.mag(), p->mass, nodes[0].totalMass, k, power);
+            }
+        } else if (!nodes.empty()) {
+            computeForceRecursive(0, p, k, power, w);
+        }
+        return finishWalk(p, k, power, w, potential, interactions);
+    }
+
+    size_t outlierCount() const { return outliers.size(); }
+    size_t nodeCount() const { return nodes.size(); }
+    size_t memoryUsed() const { return nodes.size() * sizeof(Node) + drift.size() * sizeof(float); }
+    int depth() const { return maxDepth; }
+
+    template<typename F>
+    void forEachInRadius(const Vec2D<double>& center, double radius, F visit) const {
+        if (nodes.empty()) return;
+        radiusRecursive(0, center, radius, visit);
+        for (Particle* o : outliers) if ((o->pos - center).magSq() <= radius * radius) visit(o);
+    }
+
+    // see BarnesHutTree::closePairs
+    void closePairs(double radius, std::vector<std::pair<Particle*, Particle*>>& out, unsigned threads) {
+        out.clear();
+        if (nodes.empty() || !bodies) return;
+        threads = max(threads, 1u);
+        if (pairScratch.size() < threads) pairScratch.resize(threads);
+        for (auto& buf : pairScratch) buf.clear();
+        ParticleVector& ps = *bodies;
+        parallel_for(ps.size(), threads, [&](size_t b, size_t e, unsigned t) {
+            auto& buf = pairScratch[t];
+            for (size_t i = b; i < e; ++i) {
+                Particle* p = &ps[i];
+                forEachInRadius(p->pos, radius, [&](Particle* q) { if (q > p) buf.push_back({p, q}); });
+            }
+        }, 256);
+        for (const auto& buf : pairScratch) out.insert(out.end(), buf.begin(), buf.end());
+    }
+
+    // Bodies of the last build in tree order, escapers last
+    void collectBodies(std::vector<Particle*>& out) const {
+        out.assign(order.begin(), order.end());
+        out.insert(out.end(), outliers.begin(), outliers.end());
+    }
+
+    // As BarnesHutTree::collectAggregates; maxLevel counts binary levels here, and a
+    // node's size is the longer side of its tight box
+    void collectAggregates(int maxLevel, double minCellSize, std::vector<NodeAggregate>& out) const {
+        out.clear();
+        if (!nodes.empty()) collectRecursive(0, 0, maxLevel, minCellSize, out);
+        for (const Particle* o : outliers) out.push_back({o->pos, o->mass, 0.0});
+    }
+};
+
+struct ListCacheStats {
+    size_t rebuilds = 0;   // steps that rebuilt the tree and dropped every list
+    size_t walks = 0;      // lists recorded by a tree walk
+    size_t reused = 0;     // forces evaluated from a list kept from an earlier step
+
+    double skippedFraction() const { return walks + reused ? (double)reused / (walks + reused) : 0.0; }
+};
+
+// Interaction lists kept across steps (Simulation::setInteractionCache). After a build each
+// body walks the k-d tree once and records the nodes and bodies it interacted with; later
+// steps refit the node aggregates and sum the lists. Nodes are accepted with slack for the
+// body moving skin and the node's bodies moving at least skin further (KdTree::acceptNode),
+// so a body walks again once it moved more than skin since its own walk or a node on its
+// list drifted past its allowance. Once too many bodies drifted more than skin from the
+// build, the caller rebuilds.
+class InteractionCache {
+private:
+    double skin = 0;
+    double rebuildFraction = 0.1;
+    std::vector<std::vector<KdTree::ListEntry>> lists;   // by particle index
+    std::vector<Vec2D<double>> buildPos, walkPos;
+    std::vector<float> drift;
+    std::vector<char> fresh, walked;                      // walked: 0 reused, 1 walked again, 2 first walk
+    size_t rewalked = 0;                                  // bodies walked again in the last step
+    std::vector<size_t> driftPartial;
+    std::vector<std::vector<KdTree::ListEntry>> spare;
+    std::vector<std::pair<size_t, size_t>> owners, arrivals;   // (id, index) at the last rebuild / now
+    bool ready = false;
+    ListCacheStats stats;
+
+public:
+    // skin <= 0 turns caching off; fraction: share of bodies that may drift beyond skin
+    // before usable() asks for a rebuild
+    void setSkin(double _skin, double fraction = 0.1) {
+        skin = max(_skin, 0.0);
+        rebuildFraction = fraction;
+        ready = false;
+    }
+    bool enabled() const { return skin > 0; }
+    void invalidate() { ready = false; }
+    const ListCacheStats& getStats() const { return stats; }
+
+    // true when the lists can serve another step of these bodies (same bodies, same order)
+    bool usable(const ParticleVector& ps, unsigned threads) {
+        if (!ready || lists.size() != ps.size()) return false;
+        // once most lists went stale on the refit tree, a rebuild is cheaper than walking
+        // again, and it keeps the lists from growing with the refit nodes
+        if (rewalked > ps.size() / 2) return false;
+        driftPartial.assign(max(threads, 1u), 0);
+        parallel_for(ps.size(), threads, [&](size_t b, size_t e, unsigned t) {
+            size_t far = 0;
+            for (size_t i = b; i < e; ++i) {
+                drift[i] = (float)(ps[i].pos - buildPos[i]).mag();
+                far += drift[i] > skin;
+            }
+            driftPartial[t] = far;
+        });
+        size_t count = 0;
+        for (size_t c : driftPartial) count += c;
+        return count <= rebuildFraction * ps.size();
+    }
+
+    // after a build: every body walks at its next force evaluation
+    void rebuilt(const ParticleVector& ps) {
+        size_t n = ps.size();
+        // the sort before a build moves bodies around; each list follows its body, so a
+        // body keeps the capacity its own walks need and later walks do not reallocate
+        arrivals.resize(n);
+        for (size_t i = 0; i < n; ++i) arrivals[i] = {ps[i].id, i};
+        std::sort(arrivals.begin(), arrivals.end());
+        bool same = owners.size() == n && lists.size() == n;
+        for (size_t i = 0; same && i < n; ++i) same = owners[i].first == arrivals[i].first;
+        if (same) {
+            spare.resize(n);
+            for (size_t i = 0; i < n; ++i) spare[arrivals[i].second].swap(lists[owners[i].second]);
+            lists.swap(spare);
+        } else {
+            lists.resize(n);
+        }
+        owners.swap(arrivals);
+        buildPos.resize(n);
+        walkPos.resize(n);
+        for (size_t i = 0; i < n; ++i) buildPos[i] = ps[i].pos;
+        drift.assign(n, 0.0f);
+        fresh.assign(n, 1);
+        walked.assign(n, 0);
+        rewalked = 0;
+        ready = true;
+        ++stats.rebuilds;
+    }
+
+    // after refitting the tree for a step that reuses the lists
+    void refitted(KdTree& tree, const ParticleVector& ps) { tree.measureDrift(drift, ps.data()); }
+    // force on body i, from its list or from a new walk; bodies are independent, so this
+    // may run in parallel over i
+    Vec2D<double> forceOn(const KdTree& tree, const ParticleVector& ps, size_t i, double k, double power,
+                          double* potential = nullptr, size_t* interactions = nullptr) {
+        const Particle* p = &ps[i];
+        std::vector<KdTree::ListEntry>& list = lists[i];
+        bool walk = fresh[i] || (p->pos - walkPos[i]).magSq() > skin * skin || !tree.listValid(list);
+        walked[i] = walk + fresh[i];
+        if (!walk) return tree.evaluateList(p, list, ps.data(), k, power, potential, interactions);
+        walkPos[i] = p->pos;
+        fresh[i] = 0;
+        Vec2D<double> f = tree.recordList(p, k, power, skin, ps.data(), list, potential, interactions);
+        // a quarter of headroom: a later walk a little longer should not reallocate
+        if (list.size() * 5 > list.capacity() * 4) list.reserve(list.size() * 3 / 2);
+        return f;
+    }
+
+    // adds the step's walks and reuses to the totals
+    void countStep() {
+        rewalked = 0;
+        for (char w : walked) {
+            if (w) ++stats.walks;
+            else ++stats.reused;
+            rewalked += w == 1;
+        }
+    }
+};
+
+}
@@ -7,167 +7,21 @@
 #include <algorithm>
 #include <stdexcept>
 #include <iomanip>
-#include "ds.hpp"
 #include <chrono>
+#include "simulation.hpp"
+#include "batch.hpp"
+#include "parareal.hpp"
+#include "out_of_core.hpp"
 
 using namespace std;
 
-constexpr double G_CONST = 6.67430e-11;
-constexpr double COULOMB_K = 8.98755e9;
-
-class Simulation {
-private:
-    vector<ds::Particle> particles;
-    unique_ptr<ds::BarnesHutTree> tree;
-    ds::HashTable<int, ds::Particle*> registry;
-    
-    double timeStep;
-    ds::BoundingBox boundaries;
-
-    // Force Config
-    double K_val;
-    double Dist_Pow;
-
-    ofstream dataFile;
-
-public:
-    Simulation(): registry(1009) {
-        timeStep = 0.01;
-        boundaries = {ds::Vec2D(0.0,0.0), 1000};
-    }
-
-    void initFromFile(const string& filename, double k, double pow) {
-        K_val = k;
-        Dist_Pow = pow;
-        particles.clear();
-        particles.reserve(1000);
-
-        ifstream infile(filename);
-        if (!infile.is_open()) throw runtime_error("File error");
-
-        string line;
-        int idCounter = 0;
-        while (getline(infile, line)) {
-            if (line.empty()) continue;
-            stringstream ss(line);
-            double x, y, m, vx, vy;
-            char c1, c2, c3, c4; // eat commas
-
-            if (ss >> x >> c1 >> y >> c2 >> m >> c3 >> vx >> c4 >> vy) {
-                ds::Particle p;
-                p.id = idCounter++;
-                p.pos = {x, y};
-                p.mass = m;
-                p.vel = {vx, vy}; 
-                p.acc = {0.0, 0.0};
-                // p.isStatic = (m > 1e7);
-                particles.push_back(p);
-            }
-        }
-
-        for (int i = 0; i<particles.size(); i++){
-            registry.insert(particles[i].id, &particles[i]);
-        }
-
-        tree = make_unique<ds::BarnesHutTree>(particles.size() * 2);
-        updateBounds();
-    }
-
-    void initFromManual(int n, double k, double pow) {
-        K_val = k;
-        Dist_Pow = pow;
-        particles.clear();
-        cout << "Enter " << n << " particles (x, y, mass):\n";
-        for(int i=0; i<n; ++i) {
-            double x, y, m;
-            cout << "P" << i << ": "; cin >> x >> y >> m;
-            ds::Particle p;
-            p.id = i; p.pos = {x, y}; p.mass = m;
-            p.vel = {0.0,0.0}; p.acc = {0.0,0.0}; p.isStatic = false;
-            particles.push_back(p);
-        }
-        tree = make_unique<ds::BarnesHutTree>(particles.size() * 2);
-        updateBounds();
-    }
-    
-    void updateBounds() {
-        double maxCoord = 0;
-        for(const auto& p : particles) {
-            maxCoord = max({maxCoord, abs(p.pos.x), abs(p.pos.y)});
-        }
-        boundaries.halfDim = maxCoord * 1.5 + 10.0;
-    }
-
-    void step() {
-        auto cmp = [](const ds::Particle& a, const ds::Particle& b) {
-            return a.pos.x < b.pos.x;
-        };
-        ds::merge_sort(particles.begin(), particles.end(), cmp);
-
-        for(size_t i=0; i<particles.size(); ++i) {
-            registry.insert(particles[i].id, &particles[i]); 
-        }
-        // tree init
-        updateBounds();
-        tree->build(particles, boundaries);
-
-        ds::Queue<ds::Particle*> jobQueue;
-        for (auto& p: particles){
-            if (!p.isStatic) jobQueue.enqueue(&p);
-        }
-
-        ds::Stack<ds::Particle*> integrationStack;
-
-        while (!jobQueue.empty()){
-            ds::Particle* p = jobQueue.front();
-            jobQueue.dequeue();
-            ds::Vec2D force = tree->getForceOn(p, K_val, Dist_Pow);
-            p->acc = force / p->mass;
-
-            integrationStack.push(p);
-        }
-
-        while (!integrationStack.empty()) {
-            ds::Particle* p = integrationStack.top();
-            integrationStack.pop();
-
-            p->vel += p->acc * timeStep;
-            p->pos += p->vel * timeStep;
-        }
-    }
-
-    void run(int steps, const string& filename) {
-        dataFile.open(filename);
-        if(!dataFile.is_open()) throw runtime_error("Cannot open file");
-        
-        cout << "Starting Simulation: " << steps << " steps.\n";
-        
-        for(int i=0; i<steps; i++) {
-            step();
-            // Save every frame (for now)
-            for(size_t j=0; j<particles.size(); ++j) {
-                dataFile << particles[j].pos.x << ", " << particles[j].pos.y  <<  ", " << particles[j].mass << "\n";
-            }
-            dataFile << "\n\n";
-            int MOD = steps/10;
-            if (i % MOD == 0){
-                cout << "Step " << i << " complete.\n";
-                ds::Particle* watchedParticle = registry.search(0);
-                cout << "[Step " << i << "] Particle #0 Pos: " << watchedParticle->pos << "\n";
-            }
-        }
-        dataFile.close();
-        cout << "Done.\n";
-    }
-};
-
 void printHeader(string title) {
     cout << "\033[1;36m" << string(40, '=') << "\n";
     cout << "  " << title << "\n";
     cout << string(40, '=') << "\033[0m\n";
 }
 
-void runner() {
+void runner(const string& metricsEndpoint = "") {
     Simulation sim;
     double k, p;
     int choice;
@@ -203,6 +57,8 @@ void runner() {
         int steps;
         cout << "\n4) Simulation Steps: "; cin >> steps;
 
+        if (!metricsEndpoint.empty()) cout << "Serving metrics on " << sim.enableMetrics(metricsEndpoint) << "\n";
+
         auto start = chrono::high_resolution_clock::now();
         sim.run(steps, "simulation_output.txt");
         auto end = chrono::high_resolution_clock::now();
@@ -215,6 +71,91 @@ void runner() {
     }
 }
 
-int main() {
+void batchRunner(const string& filename, unsigned threads) {
+    printHeader("BARNES-HUT BATCH MODE");
+    try {
+        vector<SimConfig> configs = loadBatchConfig(filename);
+        cout << "Running " << configs.size() << " simulations on " << threads << " threads.\n";
+
+        BatchResult r = runBatch(configs, threads);
+
+        cout << "Completed: " << r.completed << ", failed: " << r.failed << "\n";
+        cout << "\033[1;32mTotal Time: " << fixed << setprecision(4) << r.seconds << "s\033[0m\n";
+        cout << "Throughput: " << setprecision(1) << r.stepsPerSecond() << " steps/s, "
+             << r.particleStepsPerSecond() << " particle-steps/s\n";
+    } catch (const exception& e) {
+        cerr << "\033[1;31mERROR: " << e.what() << "\033[0m" << endl;
+    }
+}
+
+void pararealRunner(const PararealConfig& cfg, const string& input) {
+    printHeader("BARNES-HUT PARAREAL MODE");
+    try {
+        Simulation loader;
+        loader.setVerbose(false);
+        loader.initFromFile(input, cfg.k, cfg.power);
+        ds::ParticleVector bodies(loader.getParticles());
+        bodies.insert(bodies.end(), loader.getStaticBodies().begin(), loader.getStaticBodies().end());
+
+        PararealResult r = Parareal(cfg).run(std::move(bodies));
+        printPararealReport(cout, cfg, r);
+    } catch (const exception& e) {
+        cerr << "\033[1;31mERROR: " << e.what() << "\033[0m" << endl;
+    }
+}
+
+void outOfCoreRunner(const ds::OutOfCoreConfig& cfg, const string& input, const string& workPrefix, int steps) {
+    printHeader("BARNES-HUT OUT-OF-CORE MODE");
+    try {
+        ds::OutOfCoreSimulation sim(cfg);
+        auto start = chrono::high_resolution_clock::now();
+        sim.init(input, workPrefix);
+        cout << sim.size() << " bodies sorted into " << sim.stateFile() << "\n";
+        sim.run(steps);
+        auto end = chrono::high_resolution_clock::now();
+        cout << "Final state: " << sim.stateFile() << "\n";
+        cout << "\033[1;32mTotal Time: " << fixed << setprecision(4) << chrono::duration<double>(end - start).count() << "s\033[0m\n";
+    } catch (const exception& e) {
+        cerr << "\033[1;31mERROR: " << e.what() << "\033[0m" << endl;
+    }
+}
+
+// ./main                          interactive runner
+// ./main --metrics <endpoint>     interactive runner serving live metrics at a port on
+//                                 localhost or at unix:<socket path>, see metrics.hpp
+// ./main --batch <file> [threads] parameter sweep, see batch.hpp for the file format
+// ./main --parareal <input> <k> <power> <dt> <steps> [slices [coarse factor]]
+//                                 time-parallel run, see parareal.hpp
+// ./main --out-of-core <input.bin> <work prefix> <k> <power> <dt> <steps>
+//                                 file-backed run, see out_of_core.hpp
+int main(int argc, char** argv) {
+    if (argc >= 8 && string(argv[1]) == "--out-of-core") {
+        ds::OutOfCoreConfig cfg;
+        cfg.k = stod(argv[4]);
+        cfg.power = stod(argv[5]);
+        cfg.timeStep = stod(argv[6]);
+        outOfCoreRunner(cfg, argv[2], argv[3], stoi(argv[7]));
+        return 0;
+    }
+    if (argc >= 7 && string(argv[1]) == "--parareal") {
+        PararealConfig cfg;
+        cfg.k = stod(argv[3]);
+        cfg.power = stod(argv[4]);
+        cfg.timeStep = stod(argv[5]);
+        cfg.steps = stoi(argv[6]);
+        if (argc >= 8) cfg.slices = stoi(argv[7]);
+        if (argc >= 9) cfg.coarseFactor = stoi(argv[8]);
+        pararealRunner(cfg, argv[2]);
+        return 0;
+    }
+    if (argc >= 3 && string(argv[1]) == "--batch") {
+        unsigned threads = argc >= 4 ? (unsigned)stoi(argv[3]) : ds::hardwareThreads();
+        batchRunner(argv[2], threads);
+        return 0;
+    }
+    if (argc >= 3 && string(argv[1]) == "--metrics") {
+        runner(argv[2]);
+        return 0;
+    }
     runner(); return 0;   
-}
\ No newline at end of file
+}
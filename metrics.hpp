@@ -0,0 +1,259 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <stdexcept>
+#ifdef __unix__
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+using namespace std;
+
+namespace ds {
+
+constexpr int METRIC_PHASES = 5;
+constexpr const char* METRIC_PHASE_NAMES[METRIC_PHASES] = {"sort", "build", "force", "integrate", "output"};
+
+// What a simulation publishes after each step.
+struct MetricsSample {
+    uint64_t steps = 0;
+    uint64_t particles = 0;
+    double stepsPerSecond = 0;               // over the last second or so of wall time
+    double phase[METRIC_PHASES] = {};        // seconds in the last step (output: last frame)
+    double phaseTotal[METRIC_PHASES] = {};   // seconds since the first step
+    uint64_t treeNodes = 0, treeBytes = 0;
+    int64_t treeDepth = 0;
+    uint64_t largeArrayBytes = 0;            // ds::largeArrayBytesInUse, process-wide
+    double interactionsPerParticle = 0;
+    uint64_t escapers = 0;
+    uint64_t framesWritten = 0;
+    double energyDrift = NAN;                // NaN until diagnostics have run
+};
+
+// Latest sample behind a sequence lock. The publishing thread never waits: it bumps
+// the sequence around relaxed word stores. Readers copy the words and retry when the
+// sequence moved meanwhile, so a scrape sees one step's numbers and never a mix.
+class MetricsBoard {
+private:
+    static constexpr size_t WORDS = (sizeof(MetricsSample) + 7) / 8;
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[WORDS];
+
+public:
+    MetricsBoard() : seq(0) { publish(MetricsSample()); }
+    MetricsBoard(const MetricsBoard&) = delete;
+    MetricsBoard& operator= (const MetricsBoard&) = delete;
+
+    void publish(const MetricsSample& s) {
+        uint64_t buf[WORDS] = {};
+        memcpy(buf, &s, sizeof(s));
+        uint64_t q = seq.load(std::memory_order_relaxed);
+        seq.store(q + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WORDS; ++i) words[i].store(buf[i], std::memory_order_relaxed);
+        seq.store(q + 2, std::memory_order_release);
+    }
+
+    MetricsSample read() const {
+        uint64_t buf[WORDS];
+        for (;;) {
+            uint64_t q = seq.load(std::memory_order_acquire);
+            if (q & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < WORDS; ++i) buf[i] = words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == q) break;
+        }
+        MetricsSample s;
+        memcpy(&s, buf, sizeof(s));
+        return s;
+    }
+};
+
+// Prometheus text exposition format 0.0.4
+inline string formatMetrics(const MetricsSample& s) {
+    string out;
+    char line[192];
+    auto value = [](double v, char* buf, size_t n) {
+        if (std::isnan(v)) snprintf(buf, n, "NaN");
+        else if (std::isinf(v)) snprintf(buf, n, v > 0 ? "+Inf" : "-Inf");
+        else snprintf(buf, n, "%.10g", v);
+    };
+    auto metric = [&](const char* name, const char* type, const char* help, double v) {
+        char num[32];
+        value(v, num, sizeof(num));
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %s\n", name, help, name, type, name, num);
+        out += line;
+    };
+    auto phases = [&](const char* name, const char* type, const char* help, const double* v) {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+        out += line;
+        for (int i = 0; i < METRIC_PHASES; ++i) {
+            char num[32];
+            value(v[i], num, sizeof(num));
+            snprintf(line, sizeof(line), "%s{phase=\"%s\"} %s\n", name, METRIC_PHASE_NAMES[i], num);
+            out += line;
+        }
+    };
+
+    metric("nbody_steps_total", "counter", "Steps taken.", (double)s.steps);
+    metric("nbody_steps_per_second", "gauge", "Steps per second of wall time, over about the last second.", s.stepsPerSecond);
+    metric("nbody_particles", "gauge", "Moving bodies.", (double)s.particles);
+    metric("nbody_particles_per_second", "gauge", "Body updates per second of wall time.", s.stepsPerSecond * s.particles);
+    phases("nbody_phase_seconds", "gauge", "Seconds the last step spent per phase; output is the last frame written.", s.phase);
+    phases("nbody_phase_seconds_total", "counter", "Seconds spent per phase since the first step.", s.phaseTotal);
+    metric("nbody_tree_depth", "gauge", "Deepest tree level below the root.", (double)s.treeDepth);
+    metric("nbody_tree_nodes", "gauge", "Nodes in the last tree.", (double)s.treeNodes);
+    metric("nbody_tree_bytes", "gauge", "Bytes of tree nodes in use.", (double)s.treeBytes);
+    metric("nbody_large_array_bytes", "gauge", "Bytes held by ds::LargeArrayAllocator in this process.", (double)s.largeArrayBytes);
+    metric("nbody_interactions_per_particle", "gauge", "Force terms per body in the last step.", s.interactionsPerParticle);
+    metric("nbody_escapers", "gauge", "Bodies outside the tree's box, summed directly.", (double)s.escapers);
+    metric("nbody_frames_written_total", "counter", "Output frames written.", (double)s.framesWritten);
+    metric("nbody_energy_drift", "gauge", "(E - E0) / |E0| at the last diagnostics sample.", s.energyDrift);
+    return out;
+}
+
+// Serves a board over HTTP/1.0 at endpoint: "unix:<path>" for a Unix socket, otherwise
+// a TCP port on 127.0.0.1 ("9464" or "localhost:9464"; port 0 picks a free one). A
+// background thread answers one scrape at a time and only ever reads the board.
+class MetricsServer {
+private:
+    const MetricsBoard& board;
+    int fd;
+    string unixPath, bound;
+    std::atomic<bool> stopping;
+    std::thread worker;
+
+#ifdef __unix__
+    static void sendAll(int client, const string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t w = send(client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (w <= 0) return;
+            sent += (size_t)w;
+        }
+    }
+
+    void answer(int client) const {
+        timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[2048];
+        size_t len = 0;
+        while (len < sizeof(request) - 1) {
+            ssize_t r = recv(client, request + len, sizeof(request) - 1 - len, 0);
+            if (r <= 0) break;
+            len += (size_t)r;
+            request[len] = 0;
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+        }
+        request[len] = 0;
+
+        string status = "200 OK", body;
+        if (strncmp(request, "GET ", 4) != 0) {
+            status = "405 Method Not Allowed";
+        } else if (strncmp(request + 4, "/ ", 2) == 0 || (strncmp(request + 4, "/metrics", 8) == 0 &&
+                                                          strchr(" ?", request[12]))) {
+            body = formatMetrics(board.read());
+        } else {
+            status = "404 Not Found";
+        }
+        sendAll(client, "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                        to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+    }
+
+    void serve() {
+        pollfd p = {fd, POLLIN, 0};
+        while (!stopping.load(std::memory_order_relaxed)) {
+            if (poll(&p, 1, 100) <= 0) continue;
+            int client = accept(fd, nullptr, nullptr);
+            if (client < 0) continue;
+            answer(client);
+            close(client);
+        }
+    }
+#endif
+
+public:
+    MetricsServer(const MetricsBoard& b, const string& endpoint) : board(b), fd(-1), stopping(false) {
+#ifdef __unix__
+        if (endpoint.compare(0, 5, "unix:") == 0) {
+            unixPath = endpoint.substr(5);
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (unixPath.empty() || unixPath.size() >= sizeof(addr.sun_path))
+                throw invalid_argument("Metrics: bad socket path " + unixPath);
+            memcpy(addr.sun_path, unixPath.c_str(), unixPath.size() + 1);
+            // a socket left behind by an earlier run is replaced, any other file is not
+            struct stat st;
+            if (lstat(unixPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(unixPath.c_str());
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0 || ::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+                if (fd >= 0) close(fd);
+                throw runtime_error("Metrics: cannot listen on " + endpoint);
+            }
+            bound = endpoint;
+        } else {
+            string port = endpoint;
+            size_t colon = port.rfind(':');
+            if (colon != string::npos) {
+                string host = port.substr(0, colon);
+                if (host != "localhost" && host != "127.0.0.1")
+                    throw invalid_argument("Metrics: only serves on localhost, got " + host);
+                port = port.substr(colon + 1);
+            }
+            size_t used = 0;
+            long number = -1;
+            try { number = stol(port, &used); } catch (const exception&) {}
+            if (used != port.size() || number < 0 || number > 65535)
+                throw invalid_argument("Metrics: bad endpoint " + endpoint);
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons((uint16_t)number);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            int on = 1;
+            if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            socklen_t size = sizeof(addr);
+            if (fd < 0 || ::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0 ||
+                getsockname(fd, (sockaddr*)&addr, &size) != 0) {
+                if (fd >= 0) close(fd);
+                throw runtime_error("Metrics: cannot listen on " + endpoint);
+            }
+            bound = "127.0.0.1:" + to_string(ntohs(addr.sin_port));
+        }
+        worker = std::thread([this] { serve(); });
+#else
+        (void)endpoint;
+        throw runtime_error("Metrics: the metrics server needs a POSIX system");
+#endif
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator= (const MetricsServer&) = delete;
+
+    ~MetricsServer() {
+        stopping = true;
+        if (worker.joinable()) worker.join();
+#ifdef __unix__
+        if (fd >= 0) close(fd);
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+#endif
+    }
+
+    // "unix:<path>" or "127.0.0.1:<port>", with the actual port when 0 was asked for
+    const string& address() const { return bound; }
+};
+
+}
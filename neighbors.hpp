@@ -0,0 +1,259 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include "ds.hpp"
+
+using namespace std;
+
+namespace ds {
+
+// Short-range engine: uniform cells of side cutoff + skin, and Verlet lists of every
+// pair within that radius. Open domains fold the cells' Morton codes into about 2N
+// buckets, so far-flung bodies cost nothing and nearby cells stay nearby in memory;
+// periodic boxes use a plain grid over the box. Bodies are kept internally in bucket
+// order (SoA), lists hold those sorted indices. The lists stay valid until some body has moved more than
+// skin / 2, so they are rebuilt every few steps instead of every step. Interactions
+// beyond the cutoff are dropped (plain truncation, no shift).
+class NeighborList {
+private:
+    double cutoff, skin;
+    double periodicBox;   // > 0: minimum image in a box at boxOrigin
+    Vec2D<double> boxOrigin;
+    bool built;
+
+    // grid: nx * ny cells when periodic, otherwise nx buckets
+    size_t nx, ny;
+    double cellSize;
+    Vec2D<double> origin;
+    vector<size_t> cellStart;   // sorted bodies of bucket c: cellStart[c] .. cellStart[c+1]
+    vector<uint32_t> order;     // sorted index -> particle index
+    vector<uint32_t> cellOf;
+
+    // CSR lists over sorted indices: neighbours of k are nbr[offset[k] .. offset[k+1])
+    vector<size_t> offset;
+    vector<uint32_t> nbr;
+    vector<double> refX, refY;  // positions at the last build, by particle index
+
+    // SoA copies in sorted order for the force loop
+    vector<double> xs, ys, ms;
+    size_t rebuilds;
+    // scratch of needsRebuild and build, kept so steady-state steps do not allocate
+    mutable vector<char> moved;
+    vector<size_t> fill;
+
+    void wrap(double& dx, double& dy) const {
+        double h = periodicBox * 0.5;
+        if (dx > h) dx -= periodicBox; else if (dx < -h) dx += periodicBox;
+        if (dy > h) dy -= periodicBox; else if (dy < -h) dy += periodicBox;
+    }
+
+    // cell coordinate, clamped so huge spreads alias into far cells instead of overflowing
+    long long cellCoord(double v, double o) const {
+        return (long long)min(max(floor((v - o) / cellSize), -1.0), 4294967294.0);
+    }
+
+    size_t bucketOf(long long x, long long y) const {
+        if (periodicBox > 0) {
+            x = ((x % (long long)nx) + (long long)nx) % (long long)nx;
+            y = ((y % (long long)ny) + (long long)ny) % (long long)ny;
+            return (size_t)y * nx + (size_t)x;
+        }
+        // +1: the stencil reaches one cell below the origin
+        uint64_t code = mortonCode((uint32_t)(x + 1), (uint32_t)(y + 1));
+        return (size_t)(code & (nx - 1));
+    }
+
+    // the distinct buckets of the 9 cells around sorted body i; small periodic grids and
+    // folded Morton codes can map several cells to one bucket, visited only once
+    int stencil(size_t i, size_t* cells) const {
+        long long cx = cellCoord(xs[i], origin.x), cy = cellCoord(ys[i], origin.y);
+        int count = 0;
+        for (int oy = -1; oy <= 1; ++oy) {
+            for (int ox = -1; ox <= 1; ++ox) {
+                size_t c = bucketOf(cx + ox, cy + oy);
+                if (find(cells, cells + count, c) == cells + count) cells[count++] = c;
+            }
+        }
+        return count;
+    }
+
+    // visits every sorted j != i within the list radius of sorted body i
+    template<typename F>
+    void forEachCandidate(size_t i, F visit) const {
+        double rl2 = (cutoff + skin) * (cutoff + skin);
+        size_t cells[9];
+        int count = stencil(i, cells);
+        for (int s = 0; s < count; ++s) {
+            for (size_t j = cellStart[cells[s]]; j < cellStart[cells[s] + 1]; ++j) {
+                if (j == i) continue;
+                double dx = xs[j] - xs[i], dy = ys[j] - ys[i];
+                if (periodicBox > 0) wrap(dx, dy);
+                if (dx * dx + dy * dy < rl2) visit((uint32_t)j);
+            }
+        }
+    }
+
+    // 1 / r^e, integer exponents by multiplication
+    static double invPow(double r, double e) {
+        int n = (int)e;
+        if (n != e || n < 0 || n > 16) return pow(r, -e);
+        double inv = 1.0 / r, v = 1.0;
+        for (int i = 0; i < n; ++i) v *= inv;
+        return v;
+    }
+
+public:
+    NeighborList(double _cutoff = 0, double _skin = 0)
+        : cutoff(_cutoff), skin(_skin), periodicBox(0), built(false), nx(1), ny(1), cellSize(1), rebuilds(0) {}
+
+    void setCutoff(double _cutoff, double _skin) {
+        if (_cutoff <= 0 || _skin < 0) throw invalid_argument("NeighborList: cutoff must be positive, skin non-negative");
+        cutoff = _cutoff;
+        skin = _skin;
+        built = false;
+    }
+
+    // boxSize <= 0 switches back to open boundaries
+    void setPeriodic(double boxSize, Vec2D<double> lowerCorner) {
+        periodicBox = max(boxSize, 0.0);
+        boxOrigin = lowerCorner;
+        built = false;
+    }
+
+    // forces a rebuild at the next step, e.g. after the bodies were replaced
+    void invalidate() { built = false; }
+
+    double getCutoff() const { return cutoff; }
+    double getSkin() const { return skin; }
+    size_t rebuildCount() const { return rebuilds; }
+    size_t pairCount() const { return nbr.size(); }
+
+    // true when the lists are missing, sized for other bodies, or someone moved more than skin / 2
+    bool needsRebuild(const ParticleVector& particles, unsigned threads) const {
+        if (!built || refX.size() != particles.size()) return true;
+        double limit = skin * skin * 0.25;
+        moved.assign(max(threads, 1u), 0);
+        parallel_for(particles.size(), threads, [&](size_t b, size_t e, unsigned t) {
+            for (size_t i = b; i < e; ++i) {
+                double dx = particles[i].pos.x - refX[i], dy = particles[i].pos.y - refY[i];
+                if (periodicBox > 0) wrap(dx, dy);
+                if (dx * dx + dy * dy > limit) { moved[t] = 1; return; }
+            }
+        });
+        return find(moved.begin(), moved.end(), 1) != moved.end();
+    }
+
+    void build(const ParticleVector& particles, unsigned threads) {
+        if (cutoff <= 0) throw runtime_error("NeighborList: cutoff not set");
+        size_t n = particles.size();
+        if (n >= UINT32_MAX) throw overflow_error("NeighborList: too many bodies");
+        refX.resize(n); refY.resize(n);
+        double minX = INFINITY, minY = INFINITY;
+        for (size_t i = 0; i < n; ++i) {
+            refX[i] = particles[i].pos.x;
+            refY[i] = particles[i].pos.y;
+            if (!isfinite(refX[i]) || !isfinite(refY[i])) throw runtime_error("NeighborList: non-finite position");
+            minX = min(minX, refX[i]);
+            minY = min(minY, refY[i]);
+        }
+
+        double rl = cutoff + skin;
+        if (periodicBox > 0) {
+            origin = boxOrigin;
+            nx = ny = max<size_t>((size_t)(periodicBox / rl), 1);
+            cellSize = periodicBox / nx;
+        } else {
+            origin = n ? Vec2D<double>(minX, minY) : Vec2D<double>(0.0, 0.0);
+            cellSize = rl;
+            nx = 1;
+            while (nx < 2 * n) nx <<= 1;
+            ny = 1;
+        }
+
+        // counting sort of bodies by bucket, then the SoA copies in that order
+        cellOf.resize(n);
+        cellStart.assign(nx * ny + 1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            cellOf[i] = (uint32_t)bucketOf(cellCoord(refX[i], origin.x), cellCoord(refY[i], origin.y));
+            ++cellStart[cellOf[i] + 1];
+        }
+        for (size_t c = 0; c < nx * ny; ++c) cellStart[c + 1] += cellStart[c];
+        order.resize(n);
+        fill.assign(cellStart.begin(), cellStart.end() - 1);
+        for (size_t i = 0; i < n; ++i) order[fill[cellOf[i]]++] = (uint32_t)i;
+        xs.resize(n); ys.resize(n); ms.resize(n);
+        for (size_t k = 0; k < n; ++k) {
+            xs[k] = refX[order[k]];
+            ys[k] = refY[order[k]];
+            ms[k] = particles[order[k]].mass;
+        }
+
+        // count, prefix, fill: each body's list is written by one thread only
+        offset.assign(n + 1, 0);
+        parallel_for(n, threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t i = b; i < e; ++i) {
+                size_t c = 0;
+                forEachCandidate(i, [&](uint32_t) { ++c; });
+                offset[i + 1] = c;
+            }
+        }, 256);
+        for (size_t i = 0; i < n; ++i) offset[i + 1] += offset[i];
+        nbr.resize(offset[n]);
+        parallel_for(n, threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t i = b; i < e; ++i) {
+                size_t q = offset[i];
+                forEachCandidate(i, [&](uint32_t j) { nbr[q++] = j; });
+            }
+        }, 256);
+
+        built = true;
+        ++rebuilds;
+    }
+
+    // Sets each body's acc from the bodies within the cutoff; potential (optional,
+    // sized n) receives each body's truncated potential energy, same law as the tree.
+    void compute(ParticleVector& particles, double k, double power, vector<double>* potential, unsigned threads) {
+        size_t n = particles.size();
+        if (!built || offset.size() != n + 1) throw runtime_error("NeighborList: lists not built for these bodies");
+        parallel_for(n, threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t k = b; k < e; ++k) {
+                const Particle& p = particles[order[k]];
+                xs[k] = p.pos.x;
+                ys[k] = p.pos.y;
+                ms[k] = p.mass;
+            }
+        });
+
+        const double rc2 = cutoff * cutoff;
+        const bool periodic = periodicBox > 0;
+        const double* X = xs.data();
+        const double* Y = ys.data();
+        const double* M = ms.data();
+        parallel_for(n, threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t i = b; i < e; ++i) {
+                double xi = X[i], yi = Y[i], ax = 0, ay = 0, u = 0;
+                const uint32_t* list = nbr.data() + offset[i];
+                size_t len = offset[i + 1] - offset[i];
+                for (size_t q = 0; q < len; ++q) {
+                    uint32_t j = list[q];
+                    double dx = X[j] - xi, dy = Y[j] - yi;
+                    if (periodic) wrap(dx, dy);
+                    double r2 = dx * dx + dy * dy;
+                    if (r2 >= rc2) continue;
+                    double r = max(sqrt(r2), SOFTENING);
+                    double f = M[j] * invPow(r, power + 1.0);
+                    ax += dx * f;
+                    ay += dy * f;
+                    if (potential) u += (power == 1.0) ? M[j] * log(r) : f * r * r / (1.0 - power);
+                }
+                particles[order[i]].acc = {k * ax, k * ay};
+                if (potential) (*potential)[order[i]] = k * M[i] * u;
+            }
+        }, 256);
+    }
+};
+
+}
@@ -0,0 +1,502 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstring>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "ds.hpp"
+#include "initial_conditions.hpp"
+
+using namespace std;
+
+namespace ds {
+
+// A binary body file (BINARY_MAGIC, count, BodyRecords) mapped read-write. Records
+// sit at offset 12, so they are copied in and out rather than accessed in place.
+class MappedBodyFile {
+private:
+    int fd;
+    char* base;
+    size_t length, count;
+    string path;
+
+    static constexpr size_t HEADER = sizeof(BINARY_MAGIC) + sizeof(uint64_t);
+
+    void release() {
+#ifdef __unix__
+        if (base) munmap(base, length);
+        if (fd >= 0) close(fd);
+#endif
+        base = nullptr;
+        fd = -1;
+    }
+
+public:
+    MappedBodyFile() : fd(-1), base(nullptr), length(0), count(0) {}
+
+    // Creates (or truncates) the file with room for n bodies
+    MappedBodyFile(const string& filename, size_t n) : fd(-1), base(nullptr), length(HEADER + n * sizeof(BodyRecord)), count(n), path(filename) {
+#ifdef __unix__
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw runtime_error("Cannot create " + filename);
+        if (ftruncate(fd, (off_t)length) != 0) {
+            release();
+            throw runtime_error("Cannot size " + filename);
+        }
+        void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            release();
+            throw runtime_error("Cannot map " + filename);
+        }
+        base = static_cast<char*>(p);
+        uint64_t c = n;
+        memcpy(base, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        memcpy(base + sizeof(BINARY_MAGIC), &c, sizeof(c));
+#else
+        throw runtime_error("MappedBodyFile: memory-mapped files need a POSIX system");
+#endif
+    }
+
+    MappedBodyFile(MappedBodyFile&& o) noexcept : fd(o.fd), base(o.base), length(o.length), count(o.count), path(std::move(o.path)) {
+        o.fd = -1;
+        o.base = nullptr;
+    }
+    MappedBodyFile& operator= (MappedBodyFile&& o) noexcept {
+        if (this != &o) {
+            release();
+            fd = o.fd; base = o.base; length = o.length; count = o.count; path = std::move(o.path);
+            o.fd = -1;
+            o.base = nullptr;
+        }
+        return *this;
+    }
+    MappedBodyFile(const MappedBodyFile&) = delete;
+    MappedBodyFile& operator= (const MappedBodyFile&) = delete;
+    ~MappedBodyFile() { release(); }
+
+    size_t size() const { return count; }
+    const string& filename() const { return path; }
+
+    BodyRecord get(size_t i) const {
+        BodyRecord r;
+        memcpy(&r, base + HEADER + i * sizeof(BodyRecord), sizeof(r));
+        return r;
+    }
+    void set(size_t i, const BodyRecord& r) { memcpy(base + HEADER + i * sizeof(BodyRecord), &r, sizeof(r)); }
+
+    // hints for the records [b, e): read ahead now, or expect a front-to-back sweep
+    void willNeed(size_t b, size_t e) const { advise(b, e, true); }
+    void sequential() const { advise(0, count, false); }
+
+    void advise(size_t b, size_t e, bool now) const {
+#ifdef __unix__
+        if (!base || b >= e) return;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t from = (HEADER + b * sizeof(BodyRecord)) / page * page;
+        size_t to = min(length, HEADER + e * sizeof(BodyRecord));
+        madvise(base + from, to - from, now ? MADV_WILLNEED : MADV_SEQUENTIAL);
+#endif
+    }
+};
+
+struct OutOfCoreConfig {
+    double k = G_CONST;
+    double power = 2.0;
+    double timeStep = 0.01;
+    double theta = THETA_DEFAULT;
+    size_t leafSize = 4096;       // bodies per top-tree leaf
+    size_t blockLeaves = 16;      // top-tree leaves per processing block
+    size_t sortMemory = size_t(256) << 20; // bytes for one run of the external sort
+    int resortEvery = 8;          // steps between Morton re-sorts (0 = never)
+    unsigned threads = hardwareThreads();
+};
+
+struct OutOfCoreStats {
+    size_t blocks = 0;
+    size_t topNodes = 0;
+    double meanNearBodies = 0;    // bodies loaded per block, its own included
+    double meanFarNodes = 0;      // top-tree aggregates per block
+    double prefetchWait = 0;      // seconds the compute thread waited for a load
+    double seconds = 0;
+};
+
+// Out-of-core stepping for body sets larger than RAM. Bodies live in a Morton-ordered,
+// memory-mapped body file, so every top-tree node is a contiguous range of it. The
+// in-memory top tree keeps only range aggregates (mass, CoM, tight box) down to leaves
+// of leafSize bodies. Each block of consecutive leaves loads its own bodies plus the
+// leaves too close to summarise, walks them with an ordinary BarnesHutTree, adds the
+// accepted aggregates as monopoles and writes the integrated bodies to the second file
+// at the same positions. A prefetch thread, started once and kept for the whole run,
+// plans and loads the next block meanwhile.
+// Motion slowly spoils the order, which only loosens the boxes; a periodic external
+// re-sort restores it. Open boundaries, plain Barnes-Hut forces.
+class OutOfCoreSimulation {
+private:
+    OutOfCoreConfig cfg;
+    MappedBodyFile current, next;
+    long long stepCount;
+    OutOfCoreStats last;
+
+    struct RangeNode {
+        size_t begin, end;
+        double mass;
+        Vec2D<double> com;
+        double minX, minY, maxX, maxY;
+        size_t firstChild, childCount; // childCount 0: leaf
+    };
+    vector<RangeNode> top; // leaves first, root last
+    size_t leafCount;
+
+    struct BlockWork {
+        size_t begin = 0, end = 0;  // the block's own records
+        vector<size_t> far;         // accepted top nodes
+        vector<size_t> nearLeaves;
+        ParticleVector bodies;      // own bodies first, then the near leaves'
+    };
+    unique_ptr<BarnesHutTree> nearTree;
+    BlockWork cur, ahead; // computed and prefetched block, kept so their buffers are reused
+
+    // Prefetch thread: waits for a block number and target in prefetchTarget, loads it,
+    // clears prefetchTarget. Errors are handed back to the compute thread.
+    thread prefetcher;
+    mutex prefetchLock;
+    condition_variable prefetchCv;
+    BlockWork* prefetchTarget = nullptr;
+    size_t prefetchBlock = 0;
+    bool prefetchStop = false;
+    exception_ptr prefetchError;
+
+    static Particle toParticle(const BodyRecord& r, size_t id) {
+        Particle p(id);
+        p.pos = {r.x, r.y};
+        p.vel = {r.vx, r.vy};
+        p.mass = r.m;
+        return p;
+    }
+
+    void buildTopTree() {
+        size_t n = current.size();
+        leafCount = max<size_t>((n + cfg.leafSize - 1) / cfg.leafSize, 1);
+        top.assign(leafCount, RangeNode{});
+        parallel_for(leafCount, cfg.threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t l = b; l < e; ++l) {
+                RangeNode& node = top[l];
+                node = {l * cfg.leafSize, min(n, (l + 1) * cfg.leafSize), 0, {0.0, 0.0},
+                        INFINITY, INFINITY, -INFINITY, -INFINITY, 0, 0};
+                Vec2D<double> weighted(0.0, 0.0);
+                for (size_t i = node.begin; i < node.end; ++i) {
+                    BodyRecord r = current.get(i);
+                    node.mass += r.m;
+                    weighted += Vec2D<double>(r.x, r.y) * r.m;
+                    node.minX = min(node.minX, r.x); node.maxX = max(node.maxX, r.x);
+                    node.minY = min(node.minY, r.y); node.maxY = max(node.maxY, r.y);
+                }
+                node.com = node.mass > 0 ? weighted * (1.0 / node.mass) : Vec2D<double>(0.0, 0.0);
+            }
+        }, 1);
+        // four consecutive ranges per parent, up to a single root
+        size_t levelBegin = 0, levelEnd = leafCount;
+        while (levelEnd - levelBegin > 1) {
+            for (size_t c = levelBegin; c < levelEnd; c += 4) {
+                RangeNode parent{top[c].begin, 0, 0, {0.0, 0.0}, INFINITY, INFINITY, -INFINITY, -INFINITY, c, min<size_t>(4, levelEnd - c)};
+                Vec2D<double> weighted(0.0, 0.0);
+                for (size_t i = c; i < c + parent.childCount; ++i) {
+                    const RangeNode& ch = top[i];
+                    parent.end = ch.end;
+                    parent.mass += ch.mass;
+                    weighted += ch.com * ch.mass;
+                    parent.minX = min(parent.minX, ch.minX); parent.maxX = max(parent.maxX, ch.maxX);
+                    parent.minY = min(parent.minY, ch.minY); parent.maxY = max(parent.maxY, ch.maxY);
+                }
+                parent.com = parent.mass > 0 ? weighted * (1.0 / parent.mass) : Vec2D<double>(0.0, 0.0);
+                top.push_back(parent);
+            }
+            levelBegin = levelEnd;
+            levelEnd = top.size();
+        }
+    }
+
+    size_t blockCount() const { return (leafCount + cfg.blockLeaves - 1) / cfg.blockLeaves; }
+
+    // interaction lists of block b, then its bodies and the near leaves' bodies
+    void planAndLoad(size_t b, BlockWork& w) const {
+        size_t firstLeaf = b * cfg.blockLeaves, lastLeaf = min(leafCount, firstLeaf + cfg.blockLeaves);
+        w.begin = top[firstLeaf].begin;
+        w.end = top[lastLeaf - 1].end;
+        double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+        for (size_t l = firstLeaf; l < lastLeaf; ++l) {
+            minX = min(minX, top[l].minX); maxX = max(maxX, top[l].maxX);
+            minY = min(minY, top[l].minY); maxY = max(maxY, top[l].maxY);
+        }
+
+        w.far.clear();
+        w.nearLeaves.clear();
+        vector<size_t> stack = {top.size() - 1};
+        while (!stack.empty()) {
+            const RangeNode& node = top[stack.back()];
+            size_t idx = stack.back();
+            stack.pop_back();
+            if (node.mass <= 0) continue;
+            bool overlaps = node.begin < w.end && w.begin < node.end;
+            if (!overlaps) {
+                // opening test against the whole block: nearest point of its box
+                double dx = max({minX - node.com.x, node.com.x - maxX, 0.0});
+                double dy = max({minY - node.com.y, node.com.y - maxY, 0.0});
+                double d = sqrt(dx * dx + dy * dy);
+                double s = max(node.maxX - node.minX, node.maxY - node.minY);
+                if (d > 0 && s < cfg.theta * d) {
+                    w.far.push_back(idx);
+                    continue;
+                }
+                if (node.childCount == 0) {
+                    w.nearLeaves.push_back(idx);
+                    continue;
+                }
+            } else if (node.childCount == 0) {
+                continue; // one of the block's own leaves
+            }
+            for (size_t c = 0; c < node.childCount; ++c) stack.push_back(node.firstChild + c);
+        }
+
+        size_t total = w.end - w.begin;
+        for (size_t l : w.nearLeaves) total += top[l].end - top[l].begin;
+        w.bodies.resize(total);
+        size_t k = 0;
+        current.willNeed(w.begin, w.end);
+        for (size_t i = w.begin; i < w.end; ++i) w.bodies[k++] = toParticle(current.get(i), i);
+        for (size_t l : w.nearLeaves) {
+            for (size_t i = top[l].begin; i < top[l].end; ++i) w.bodies[k++] = toParticle(current.get(i), i);
+        }
+    }
+
+    void prefetchLoop() {
+        unique_lock<mutex> lock(prefetchLock);
+        for (;;) {
+            prefetchCv.wait(lock, [this] { return prefetchStop || prefetchTarget; });
+            if (prefetchStop) return;
+            size_t b = prefetchBlock;
+            BlockWork& w = *prefetchTarget;
+            lock.unlock();
+            try {
+                planAndLoad(b, w);
+            } catch (...) {
+                prefetchError = current_exception();
+            }
+            lock.lock();
+            prefetchTarget = nullptr;
+            prefetchCv.notify_all();
+        }
+    }
+
+    void startPrefetch(size_t b, BlockWork& w) {
+        if (!prefetcher.joinable()) prefetcher = thread(&OutOfCoreSimulation::prefetchLoop, this);
+        {
+            lock_guard<mutex> lock(prefetchLock);
+            prefetchBlock = b;
+            prefetchTarget = &w;
+        }
+        prefetchCv.notify_all();
+    }
+
+    void finishPrefetch() {
+        unique_lock<mutex> lock(prefetchLock);
+        prefetchCv.wait(lock, [this] { return !prefetchTarget; });
+        if (prefetchError) {
+            exception_ptr e = prefetchError;
+            prefetchError = nullptr;
+            rethrow_exception(e);
+        }
+    }
+
+    // forces on the block's own bodies, then the same Euler step as Simulation::step
+    void computeBlock(BlockWork& w) {
+        double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+        for (const auto& p : w.bodies) {
+            minX = min(minX, p.pos.x); maxX = max(maxX, p.pos.x);
+            minY = min(minY, p.pos.y); maxY = max(maxY, p.pos.y);
+        }
+        double half = max(max(maxX - minX, maxY - minY) * 0.5 * (1.0 + 1e-6), SOFTENING);
+        if (!nearTree) nearTree = make_unique<BarnesHutTree>(w.bodies.size() * 2, cfg.theta);
+        nearTree->build(w.bodies, {Vec2D<double>((minX + maxX) * 0.5, (minY + maxY) * 0.5), half});
+
+        size_t own = w.end - w.begin;
+        parallel_for(own, cfg.threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t i = b; i < e; ++i) {
+                Particle& p = w.bodies[i];
+                Vec2D<double> force = nearTree->getForceOn(&p, cfg.k, cfg.power);
+                for (size_t f : w.far) {
+                    Vec2D<double> rVec = top[f].com - p.pos;
+                    double dist = max(rVec.mag(), SOFTENING);
+                    force += rVec * (cfg.k * p.mass * top[f].mass / pow(dist, cfg.power) / dist);
+                }
+                p.vel += force / p.mass * cfg.timeStep;
+                p.pos += p.vel * cfg.timeStep;
+                next.set(w.begin + i, {p.pos.x, p.pos.y, p.mass, p.vel.x, p.vel.y});
+            }
+        }, 256);
+    }
+
+    // External merge sort of `current` by Morton code over its bounding box: sorted runs
+    // of at most sortMemory bytes go to `next`, then a k-way merge writes them back.
+    void sortByMorton() {
+        size_t n = current.size();
+        if (n < 2) return;
+        double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+        current.sequential();
+        for (size_t i = 0; i < n; ++i) {
+            BodyRecord r = current.get(i);
+            minX = min(minX, r.x); maxX = max(maxX, r.x);
+            minY = min(minY, r.y); maxY = max(maxY, r.y);
+        }
+        double span = max(max(maxX - minX, maxY - minY), SOFTENING);
+        double scale = 4294967295.0 / span;
+        auto key = [&](const BodyRecord& r) {
+            return mortonCode((uint32_t)min((r.x - minX) * scale, 4294967295.0),
+                              (uint32_t)min((r.y - minY) * scale, 4294967295.0));
+        };
+
+        using Keyed = pair<uint64_t, BodyRecord>;
+        size_t runLen = max<size_t>(cfg.sortMemory / sizeof(Keyed), 1024);
+        vector<Keyed> buf(min(runLen, n));
+        auto byKey = [](const Keyed& a, const Keyed& b) { return a.first < b.first; };
+        size_t runs = (n + runLen - 1) / runLen;
+        for (size_t r = 0; r < runs; ++r) {
+            size_t b = r * runLen, e = min(n, b + runLen);
+            for (size_t i = b; i < e; ++i) {
+                BodyRecord rec = current.get(i);
+                buf[i - b] = {key(rec), rec};
+            }
+            sort(buf.begin(), buf.begin() + (e - b), byKey);
+            // a single run is already the answer
+            MappedBodyFile& dst = runs == 1 ? current : next;
+            for (size_t i = b; i < e; ++i) dst.set(i, buf[i - b].second);
+        }
+        if (runs == 1) return;
+
+        using Head = pair<uint64_t, size_t>; // key, run
+        priority_queue<Head, vector<Head>, greater<Head>> heads;
+        vector<size_t> cursor(runs);
+        for (size_t r = 0; r < runs; ++r) {
+            cursor[r] = r * runLen;
+            heads.push({key(next.get(cursor[r])), r});
+        }
+        next.sequential();
+        for (size_t out = 0; out < n; ++out) {
+            size_t r = heads.top().second;
+            heads.pop();
+            current.set(out, next.get(cursor[r]));
+            if (++cursor[r] < min(n, (r + 1) * runLen)) heads.push({key(next.get(cursor[r])), r});
+        }
+    }
+
+public:
+    explicit OutOfCoreSimulation(const OutOfCoreConfig& c) : cfg(c), stepCount(0), leafCount(0) {
+        if (cfg.leafSize == 0 || cfg.blockLeaves == 0) throw invalid_argument("OutOfCore: leaf and block sizes must be positive");
+    }
+
+    ~OutOfCoreSimulation() {
+        if (!prefetcher.joinable()) return;
+        {
+            lock_guard<mutex> lock(prefetchLock);
+            prefetchStop = true;
+        }
+        prefetchCv.notify_all();
+        prefetcher.join();
+    }
+
+    OutOfCoreSimulation(const OutOfCoreSimulation&) = delete;
+    OutOfCoreSimulation& operator= (const OutOfCoreSimulation&) = delete;
+
+    // Streams a binary body file into workPrefix.a.bin (workPrefix.b.bin is the second
+    // buffer) and Morton-sorts it there; neither the input nor the store is held in RAM.
+    void init(const string& inputFile, const string& workPrefix) {
+        ifstream in(inputFile, ios::binary);
+        char magic[4];
+        uint64_t n = 0;
+        if (!in.read(magic, 4) || memcmp(magic, BINARY_MAGIC, 4) != 0 || !in.read((char*)&n, sizeof(n)))
+            throw invalid_argument("Out-of-core mode reads binary body files: " + inputFile);
+        // the work files are sized by the header count, so check it against the input first
+        auto header = in.tellg();
+        in.seekg(0, ios::end);
+        uint64_t remaining = (uint64_t)(in.tellg() - header);
+        in.seekg(header);
+        if (n > remaining / sizeof(BodyRecord)) throw runtime_error("Truncated binary body file: " + inputFile);
+        current = MappedBodyFile(workPrefix + ".a.bin", n);
+        next = MappedBodyFile(workPrefix + ".b.bin", n);
+
+        const size_t CHUNK = 1 << 16;
+        vector<BodyRecord> chunk(min<uint64_t>(n, CHUNK));
+        for (size_t b = 0; b < n; b += CHUNK) {
+            size_t len = min<size_t>(CHUNK, n - b);
+            if (!in.read((char*)chunk.data(), len * sizeof(BodyRecord)))
+                throw runtime_error("Truncated binary body file: " + inputFile);
+            for (size_t i = 0; i < len; ++i) current.set(b + i, chunk[i]);
+        }
+        sortByMorton();
+        stepCount = 0;
+    }
+
+    void step() {
+        using clock = chrono::steady_clock;
+        auto t0 = clock::now();
+        if (stepCount > 0 && cfg.resortEvery > 0 && stepCount % cfg.resortEvery == 0) sortByMorton();
+        buildTopTree();
+
+        last = OutOfCoreStats();
+        last.blocks = blockCount();
+        last.topNodes = top.size();
+        current.sequential();
+        planAndLoad(0, cur);
+        for (size_t b = 0; b < last.blocks; ++b) {
+            bool prefetching = b + 1 < last.blocks;
+            if (prefetching) startPrefetch(b + 1, ahead);
+            last.meanNearBodies += cur.bodies.size();
+            last.meanFarNodes += cur.far.size();
+            computeBlock(cur);
+            if (prefetching) {
+                auto w0 = clock::now();
+                finishPrefetch();
+                last.prefetchWait += chrono::duration<double>(clock::now() - w0).count();
+            }
+            swap(cur, ahead);
+        }
+        last.meanNearBodies /= max<size_t>(last.blocks, 1);
+        last.meanFarNodes /= max<size_t>(last.blocks, 1);
+        swap(current, next);
+        ++stepCount;
+        last.seconds = chrono::duration<double>(clock::now() - t0).count();
+    }
+
+    void run(int steps, bool verbose = true) {
+        for (int i = 0; i < steps; ++i) {
+            step();
+            if (verbose) {
+                cout << "[Step " << i << "] " << last.seconds << "s, " << last.blocks << " blocks, "
+                     << last.meanNearBodies << " near bodies and " << last.meanFarNodes
+                     << " aggregates per block, prefetch wait " << last.prefetchWait << "s\n";
+            }
+        }
+    }
+
+    const OutOfCoreStats& lastStats() const { return last; }
+    long long stepsTaken() const { return stepCount; }
+    size_t size() const { return current.size(); }
+    // the binary body file holding the latest state
+    const string& stateFile() const { return current.filename(); }
+    BodyRecord body(size_t i) const { return current.get(i); }
+};
+
+}
@@ -0,0 +1,186 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include "simulation.hpp"
+
+using namespace std;
+
+// Time-parallel integration: the window is cut into slices, a cheap coarse propagator
+// (large theta, large dt) predicts every slice boundary serially, and the accurate fine
+// propagator corrects all slices at once from the previous iteration's boundaries:
+//   U[n+1] = G(U[n]) + F(U_old[n]) - G(U_old[n])
+// After k iterations the first k slices equal the serial fine run, so it always
+// converges within `slices` iterations; the speedup comes from converging much earlier.
+struct PararealConfig {
+    double k = G_CONST;
+    double power = 2.0;
+    double timeStep = 0.01;      // fine dt
+    int steps = 1000;            // fine steps over the whole window
+    double fineTheta = 0.3;
+    double coarseTheta = 0.9;
+    int coarseFactor = 10;       // coarse dt = coarseFactor * timeStep
+    int slices = (int)ds::hardwareThreads();
+    int maxIterations = 0;       // 0 = slices
+    double tolerance = 1e-6;     // boundary change between iterations, relative to the spread
+    unsigned threads = ds::hardwareThreads();
+    bool compareSerial = true;   // also time the serial fine run and measure the deviation
+};
+
+struct PararealResult {
+    ds::ParticleVector state;    // final bodies, by id
+    int iterations = 0;
+    bool converged = false;
+    vector<double> changes;      // boundary change of each iteration
+    double seconds = 0;
+    double serialSeconds = 0;    // serial fine run, 0 if not compared
+    double speedup = 0;
+    double deviation = 0;        // RMS position difference to the serial fine run, relative to the spread
+    double maxDeviation = 0;     // largest single position difference, absolute
+};
+
+class Parareal {
+private:
+    PararealConfig cfg;
+
+    // bodies after `steps` steps of dt from state, both sorted by id
+    ds::ParticleVector propagate(const ds::ParticleVector& state, int steps, double dt, double theta) const {
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(1);
+        sim.setTimeStep(dt);
+        sim.setTheta(theta);
+        sim.initFromParticles(state, cfg.k, cfg.power);
+        for (int i = 0; i < steps; ++i) sim.step();
+        ds::ParticleVector out(sim.getParticles());
+        out.insert(out.end(), sim.getStaticBodies().begin(), sim.getStaticBodies().end());
+        sortById(out);
+        return out;
+    }
+
+    static void sortById(ds::ParticleVector& ps) {
+        sort(ps.begin(), ps.end(), [](const ds::Particle& a, const ds::Particle& b) { return a.id < b.id; });
+    }
+
+    int fineSteps(int slice) const {
+        return (int)((long long)cfg.steps * (slice + 1) / cfg.slices - (long long)cfg.steps * slice / cfg.slices);
+    }
+
+    ds::ParticleVector fine(const ds::ParticleVector& state, int slice) const {
+        return propagate(state, fineSteps(slice), cfg.timeStep, cfg.fineTheta);
+    }
+
+    // same slice length in fewer, longer steps
+    ds::ParticleVector coarse(const ds::ParticleVector& state, int slice) const {
+        int n = fineSteps(slice);
+        int m = max(1, (int)lround((double)n / cfg.coarseFactor));
+        return propagate(state, m, cfg.timeStep * n / m, cfg.coarseTheta);
+    }
+
+    // g + f - gOld on positions and velocities; static bodies are copied as they are
+    static ds::ParticleVector correct(const ds::ParticleVector& g, const ds::ParticleVector& f, const ds::ParticleVector& gOld) {
+        if (g.size() != f.size() || g.size() != gOld.size()) throw runtime_error("Parareal: body count changed during a slice");
+        ds::ParticleVector u(g);
+        for (size_t i = 0; i < u.size(); ++i) {
+            if (u[i].isStatic) continue;
+            u[i].pos += f[i].pos - gOld[i].pos;
+            u[i].vel += f[i].vel - gOld[i].vel;
+        }
+        return u;
+    }
+
+    // RMS distance of the bodies from their mean, the length scale of the tolerances
+    static double spread(const ds::ParticleVector& ps) {
+        if (ps.empty()) return 1.0;
+        ds::Vec2D<double> mean(0.0, 0.0);
+        for (const auto& p : ps) mean += p.pos;
+        mean = mean * (1.0 / ps.size());
+        double s = 0;
+        for (const auto& p : ps) s += (p.pos - mean).magSq();
+        return max(sqrt(s / ps.size()), ds::SOFTENING);
+    }
+
+    static double rmsDistance(const ds::ParticleVector& a, const ds::ParticleVector& b, double* maxDist = nullptr) {
+        double s = 0, worst = 0;
+        for (size_t i = 0; i < a.size(); ++i) {
+            double d = (a[i].pos - b[i].pos).magSq();
+            s += d;
+            worst = max(worst, d);
+        }
+        if (maxDist) *maxDist = sqrt(worst);
+        return a.empty() ? 0.0 : sqrt(s / a.size());
+    }
+
+public:
+    explicit Parareal(const PararealConfig& c) : cfg(c) {
+        if (cfg.slices < 1 || cfg.steps < cfg.slices) throw invalid_argument("Parareal: need at least one fine step per slice");
+        if (cfg.coarseFactor < 1) throw invalid_argument("Parareal: coarse factor must be at least 1");
+        if (cfg.maxIterations <= 0 || cfg.maxIterations > cfg.slices) cfg.maxIterations = cfg.slices;
+    }
+
+    PararealResult run(ds::ParticleVector initial) const {
+        using clock = chrono::steady_clock;
+        PararealResult r;
+        sortById(initial);
+        const int S = cfg.slices;
+        const double scale = spread(initial);
+
+        auto t0 = clock::now();
+        // iteration 0: serial coarse prediction of every boundary
+        vector<ds::ParticleVector> u(S + 1), gOld(S), f(S);
+        u[0] = initial;
+        for (int n = 0; n < S; ++n) {
+            gOld[n] = coarse(u[n], n);
+            u[n + 1] = gOld[n];
+        }
+
+        for (int it = 1; it <= cfg.maxIterations; ++it) {
+            // slices before it - 1 start from boundaries that no longer change
+            int firstOpen = it - 1;
+            ds::parallel_for((size_t)(S - firstOpen), cfg.threads, [&](size_t b, size_t e, unsigned) {
+                for (size_t i = b; i < e; ++i) f[firstOpen + i] = fine(u[firstOpen + i], firstOpen + (int)i);
+            }, 1);
+
+            double change = 0;
+            for (int n = firstOpen; n < S; ++n) {
+                ds::ParticleVector g = coarse(u[n], n);
+                ds::ParticleVector next = correct(g, f[n], gOld[n]);
+                change = max(change, rmsDistance(next, u[n + 1]) / scale);
+                u[n + 1] = std::move(next);
+                gOld[n] = std::move(g);
+            }
+            r.iterations = it;
+            r.changes.push_back(change);
+            if (change <= cfg.tolerance || it == S) {
+                r.converged = true;
+                break;
+            }
+        }
+        r.seconds = chrono::duration<double>(clock::now() - t0).count();
+        r.state = u[S];
+
+        if (cfg.compareSerial) {
+            auto s0 = clock::now();
+            ds::ParticleVector serial = initial;
+            for (int n = 0; n < S; ++n) serial = fine(serial, n);
+            r.serialSeconds = chrono::duration<double>(clock::now() - s0).count();
+            r.speedup = r.seconds > 0 ? r.serialSeconds / r.seconds : 0;
+            r.deviation = rmsDistance(r.state, serial, &r.maxDeviation) / scale;
+        }
+        return r;
+    }
+};
+
+inline void printPararealReport(ostream& os, const PararealConfig& cfg, const PararealResult& r) {
+    os << "Parareal: " << cfg.slices << " slices of " << cfg.steps / cfg.slices << " fine steps, coarse dt x"
+       << cfg.coarseFactor << ", theta " << cfg.fineTheta << " / " << cfg.coarseTheta << "\n";
+    for (size_t i = 0; i < r.changes.size(); ++i) os << "  iteration " << i + 1 << ": change " << r.changes[i] << "\n";
+    os << (r.converged ? "Converged" : "Not converged") << " after " << r.iterations << " iterations in " << r.seconds << "s\n";
+    if (r.serialSeconds > 0) {
+        os << "Serial fine run: " << r.serialSeconds << "s, speedup " << r.speedup << "x\n";
+        os << "Final deviation: " << r.deviation << " of the spread (RMS), " << r.maxDeviation << " max\n";
+    }
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace std;
+
+namespace ds {
+
+enum PerfEvent { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES,
+                 PERF_BRANCH_MISSES, PERF_DTLB_MISSES, PERF_EVENT_COUNT };
+
+inline const char* perfEventName(int e) {
+    static const char* names[PERF_EVENT_COUNT] = {"cycles", "instructions", "L1d_miss", "LLC_miss", "branch_miss", "dTLB_miss"};
+    return names[e];
+}
+
+// Counts for one thread over some interval; events the kernel refused are flagged invalid.
+struct PerfCounts {
+    uint64_t value[PERF_EVENT_COUNT] = {};
+    bool valid[PERF_EVENT_COUNT] = {};
+
+    PerfCounts& operator+= (const PerfCounts& o) {
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e) {
+            value[e] += o.value[e];
+            valid[e] = valid[e] || o.valid[e];
+        }
+        return *this;
+    }
+    // clamped at zero: scaled counts of a multiplexed event can step back slightly
+    PerfCounts operator- (const PerfCounts& o) const {
+        PerfCounts d;
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e) {
+            d.value[e] = value[e] > o.value[e] ? value[e] - o.value[e] : 0;
+            d.valid[e] = valid[e] && o.valid[e];
+        }
+        return d;
+    }
+    bool any() const {
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e) if (valid[e]) return true;
+        return false;
+    }
+};
+
+// perf_event_open counters for the calling thread, enabled from construction.
+// Each event is opened on its own so one unsupported event does not hide the others;
+// with no perf support at all (non-Linux, containers, paranoid settings) every read
+// returns invalid counts and nothing else happens. When the PMU has fewer slots than
+// open events the kernel multiplexes them, so reads scale each count up from the time
+// it was counting to the time it was enabled.
+class PerfCounterSet {
+private:
+    int fds[PERF_EVENT_COUNT];
+
+#ifdef __linux__
+    static int openEvent(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    static uint64_t cacheMiss(uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+#endif
+
+public:
+    PerfCounterSet() {
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e) fds[e] = -1;
+#ifdef __linux__
+        fds[PERF_CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[PERF_INSTRUCTIONS] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[PERF_L1D_MISSES] = openEvent(PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_L1D));
+        fds[PERF_LLC_MISSES] = openEvent(PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_LL));
+        fds[PERF_BRANCH_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fds[PERF_DTLB_MISSES] = openEvent(PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_DTLB));
+#endif
+    }
+
+    ~PerfCounterSet() {
+#ifdef __linux__
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e) if (fds[e] >= 0) close(fds[e]);
+#endif
+    }
+
+    PerfCounterSet(const PerfCounterSet&) = delete;
+    PerfCounterSet& operator= (const PerfCounterSet&) = delete;
+
+    bool available() const {
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e) if (fds[e] >= 0) return true;
+        return false;
+    }
+
+    PerfCounts read() const {
+        PerfCounts c;
+#ifdef __linux__
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e) {
+            uint64_t v[3]; // count, time enabled, time running
+            // an event that never got a counter (running == 0) has no estimate
+            if (fds[e] >= 0 && ::read(fds[e], v, sizeof(v)) == (ssize_t)sizeof(v) && v[2] > 0) {
+                c.value[e] = v[2] == v[1] ? v[0] : (uint64_t)((double)v[0] * v[1] / v[2]);
+                c.valid[e] = true;
+            }
+        }
+#endif
+        return c;
+    }
+};
+
+// The calling thread's counters, opened on its first call and kept for the thread's
+// life, so a pool worker opens its events once instead of once per task
+inline PerfCounterSet& threadPerfCounters() {
+    thread_local PerfCounterSet counters;
+    return counters;
+}
+
+// One row per (phase, thread): seconds, then each event, then IPC.
+inline void printPerfTable(ostream& os, const char* const* phaseNames, const double* phaseSeconds,
+                           const vector<vector<PerfCounts>>& counts) {
+    os << left << setw(10) << "phase" << setw(7) << "thread" << setw(11) << "time_s";
+    for (int e = 0; e < PERF_EVENT_COUNT; ++e) os << setw(14) << perfEventName(e);
+    os << "IPC\n";
+    for (size_t ph = 0; ph < counts.size(); ++ph) {
+        for (size_t t = 0; t < counts[ph].size(); ++t) {
+            const PerfCounts& c = counts[ph][t];
+            if (!c.any()) continue;
+            os << setw(10) << phaseNames[ph] << setw(7) << t << setw(11) << phaseSeconds[ph];
+            for (int e = 0; e < PERF_EVENT_COUNT; ++e) {
+                if (c.valid[e]) os << setw(14) << c.value[e];
+                else os << setw(14) << "n/a";
+            }
+            if (c.valid[PERF_CYCLES] && c.valid[PERF_INSTRUCTIONS] && c.value[PERF_CYCLES] > 0)
+                os << (double)c.value[PERF_INSTRUCTIONS] / c.value[PERF_CYCLES];
+            else
+                os << "n/a";
+            os << "\n";
+        }
+    }
+    os << right;
+}
+
+}
@@ -0,0 +1,181 @@
+#pragma once
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <stdexcept>
+#include "ds.hpp"
+
+using namespace std;
+
+namespace ds {
+
+// grid cells per side of the mesh (before zero padding)
+constexpr size_t PM_GRID_DEFAULT = 128;
+constexpr size_t PM_GRID_MIN = 32;
+constexpr size_t PM_GRID_MAX = 1024;
+// the bodies' box stays this many cells inside the mesh edge, or the mesh re-grids
+constexpr double PM_GUARD_CELLS = 2.0;
+// force-split scale in mesh cells, the tree cuts off at PM_CUTOFF_SPLITS split scales
+constexpr double PM_SPLIT_CELLS = 1.25;
+constexpr double PM_CUTOFF_SPLITS = 4.5;
+
+// In-place iterative radix-2 FFT, size must be a power of two.
+inline void fft(complex<double>* a, size_t n, bool inverse) {
+    for (size_t i = 1, j = 0; i < n; ++i) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) swap(a[i], a[j]);
+    }
+    for (size_t len = 2; len <= n; len <<= 1) {
+        double ang = 2 * M_PI / len * (inverse ? 1 : -1);
+        complex<double> wl(cos(ang), sin(ang));
+        for (size_t i = 0; i < n; i += len) {
+            complex<double> w(1);
+            for (size_t j = 0; j < len / 2; ++j) {
+                complex<double> u = a[i + j], v = a[i + j + len / 2] * w;
+                a[i + j] = u + v;
+                a[i + j + len / 2] = u - v;
+                w *= wl;
+            }
+        }
+    }
+    if (inverse) {
+        for (size_t i = 0; i < n; ++i) a[i] /= (double)n;
+    }
+}
+
+// In-place transpose of an n x n row-major grid
+inline void transpose(vector<complex<double>>& g, size_t n, unsigned threads) {
+    parallel_for(n, threads, [&](size_t b, size_t e, unsigned) {
+        for (size_t r = b; r < e; ++r) {
+            for (size_t c = r + 1; c < n; ++c) swap(g[r * n + c], g[c * n + r]);
+        }
+    }, 16);
+}
+
+// 2D FFT of an n x n row-major grid: rows, then the columns as rows of the transpose.
+// Leaves the grid in its original layout and needs no scratch.
+inline void fft2d(vector<complex<double>>& g, size_t n, bool inverse, unsigned threads) {
+    for (int pass = 0; pass < 2; ++pass) {
+        parallel_for(n, threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t r = b; r < e; ++r) fft(&g[r * n], n, inverse);
+        }, 16);
+        transpose(g, n, threads);
+    }
+}
+
+// Long-range half of a TreePM split: cloud-in-cell deposit, FFT convolution with the
+// long-range part of the 1/r^power law on a zero-padded (open boundary) grid, and
+// CIC interpolation back. The tree supplies the complementary short-range part.
+class ParticleMesh {
+private:
+    size_t grid;      // cells per side covering the region
+    size_t padded;    // 2 * grid, so the circular convolution does not wrap
+    double power;
+    BoundingBox region;
+    double cell;
+    vector<complex<double>> kernelHat; // FFT of (Gx + i Gy)
+    vector<complex<double>> work;
+    ForceSplit split;
+
+    void buildKernel() {
+        split.build(power, PM_SPLIT_CELLS * cell, PM_CUTOFF_SPLITS * PM_SPLIT_CELLS * cell);
+        kernelHat.assign(padded * padded, 0.0);
+        for (size_t i = 0; i < padded; ++i) {
+            for (size_t j = 0; j < padded; ++j) {
+                double dx = ((i < padded / 2) ? (double)i : (double)i - padded) * cell;
+                double dy = ((j < padded / 2) ? (double)j : (double)j - padded) * cell;
+                double r = sqrt(dx * dx + dy * dy);
+                if (r == 0) continue;
+                // field at x from a unit source at x - d, pointing back towards the source
+                double f = -split.longFactorExact(r) / (pow(r, power) * r);
+                kernelHat[i * padded + j] = complex<double>(f * dx, f * dy);
+            }
+        }
+        fft2d(kernelHat, padded, false, 1);
+    }
+
+    // b keeps PM_GUARD_CELLS from the mesh edge, so every CIC stencil of a body in b is on the grid
+    bool covers(const BoundingBox& b) const {
+        double room = region.halfDim - PM_GUARD_CELLS * cell - b.halfDim;
+        return abs(b.center.x - region.center.x) <= room && abs(b.center.y - region.center.y) <= room;
+    }
+
+public:
+    ParticleMesh(size_t _grid = PM_GRID_DEFAULT)
+        : grid(_grid), padded(2 * _grid), power(2.0), cell(0) {
+        if (grid < PM_GRID_MIN || (grid & (grid - 1)))
+            throw invalid_argument("ParticleMesh: grid must be a power of two, at least 32");
+        region = {Vec2D(0.0, 0.0), 0.0};
+    }
+
+    // About one cell per body along each axis keeps the short-range cutoff a few bodies wide.
+    static size_t gridFor(size_t n) {
+        size_t g = PM_GRID_MIN;
+        while (g * g < n && g < PM_GRID_MAX) g <<= 1;
+        return g;
+    }
+
+    size_t gridSize() const { return grid; }
+
+    // short-range law the tree must use alongside this mesh
+    const ForceSplit& forceSplit() const { return split; }
+    const BoundingBox& bounds() const { return region; }
+
+    // Re-grids (and recomputes the kernel) only when the bodies come within PM_GUARD_CELLS
+    // of the mesh edge or the mesh has become much larger than they need. The new mesh
+    // leaves grid / 10 cells around b, at least 3.2 with PM_GRID_MIN.
+    bool ensureCovers(const BoundingBox& b, double _power) {
+        if (covers(b) && _power == power && b.halfDim > region.halfDim * 0.5) return false;
+        power = _power;
+        region = {b.center, b.halfDim * 1.25};
+        cell = 2 * region.halfDim / grid;
+        buildKernel();
+        return true;
+    }
+
+    // Fills acc-like force per unit (k * m_target) for every particle. treeBox is the box
+    // the tree was built over: bodies outside it are the tree's escapers, which it sums
+    // with the full law both ways, so the mesh leaves them out and gives them zero.
+    void compute(const ParticleVector& particles, const BoundingBox& treeBox, vector<Vec2D<double>>& out,
+                 unsigned threads) {
+        if (!covers(treeBox)) throw logic_error("ParticleMesh: the mesh does not cover the tree box, call ensureCovers");
+        work.assign(padded * padded, 0.0);
+        double ox = region.center.x - region.halfDim, oy = region.center.y - region.halfDim;
+
+        for (const auto& p : particles) {
+            if (!treeBox.contains(p.pos)) continue;
+            double gx = (p.pos.x - ox) / cell - 0.5, gy = (p.pos.y - oy) / cell - 0.5;
+            size_t i = (size_t)gx, j = (size_t)gy;
+            double fx = gx - i, fy = gy - j;
+            work[i * padded + j] += p.mass * (1 - fx) * (1 - fy);
+            work[i * padded + j + 1] += p.mass * (1 - fx) * fy;
+            work[(i + 1) * padded + j] += p.mass * fx * (1 - fy);
+            work[(i + 1) * padded + j + 1] += p.mass * fx * fy;
+        }
+
+        fft2d(work, padded, false, threads);
+        // density is real, so one inverse transform of rho_hat * (Gx_hat + i Gy_hat) gives Fx + i Fy
+        for (size_t i = 0; i < work.size(); ++i) work[i] *= kernelHat[i];
+        fft2d(work, padded, true, threads);
+
+        out.assign(particles.size(), Vec2D<double>(0.0, 0.0));
+        parallel_for(particles.size(), threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t k = b; k < e; ++k) {
+                const auto& p = particles[k];
+                if (!treeBox.contains(p.pos)) continue;
+                double gx = (p.pos.x - ox) / cell - 0.5, gy = (p.pos.y - oy) / cell - 0.5;
+                size_t i = (size_t)gx, j = (size_t)gy;
+                double fx = gx - i, fy = gy - j;
+                complex<double> f = work[i * padded + j] * ((1 - fx) * (1 - fy))
+                                  + work[i * padded + j + 1] * ((1 - fx) * fy)
+                                  + work[(i + 1) * padded + j] * (fx * (1 - fy))
+                                  + work[(i + 1) * padded + j + 1] * (fx * fy);
+                out[k] = {f.real(), f.imag()};
+            }
+        });
+    }
+};
+
+}
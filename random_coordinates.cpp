@@ -1,54 +1,38 @@
 #include <iostream>
-#include <fstream>
-#include <cstdlib>
-#include <ctime>
+#include <string>
+#include <chrono>
+#include "initial_conditions.hpp"
 using namespace std;
 
-// X and Y bounds for box
-const double BOUND_X = 100.0;
-const double BOUND_Y = 100.0;
-
-const double MASS_LOW = 50;
-const double MASS_HIGH = 200;
-
-const double v_LIM = 1;
-
-void generateRandomPoints(const string& filename, int N) {
-    ofstream fout(filename);
-
-    if (!fout) {
-        cerr << "Error: Could not open file.\n";
-        return;
-    }
+// ./gen                                   prompts for N, uniform box as before
+// ./gen N [distribution] [seed] [file]    distribution: uniform, plummer, disk, clusters, lattice
+//                                         file ending in .bin is written in the binary format
+int main(int argc, char** argv) {
+    ds::GeneratorConfig cfg;
+    string filename = "random_coordinates.txt";
 
-    for (int i = 0; i < N; i++) {
-        double x = -BOUND_X + (static_cast<double>(rand()) / RAND_MAX) * (2 * BOUND_X);
-        double y = -BOUND_Y + (static_cast<double>(rand()) / RAND_MAX) * (2 * BOUND_Y);
-        double mass = MASS_LOW  
-            + (static_cast<double>(rand()) / RAND_MAX) *(MASS_HIGH - MASS_LOW);
-        double vx, vy;
-        if ((static_cast<double>(rand()) / RAND_MAX) > 0.9) {
-            vx = (static_cast<double>(rand()) / RAND_MAX) * v_LIM;
+    try {
+        if (argc > 1) {
+            cfg.n = stoull(argv[1]);
+            if (argc > 2) cfg.dist = ds::parseDistribution(argv[2]);
+            if (argc > 3) cfg.seed = stoull(argv[3]);
+            if (argc > 4) filename = argv[4];
+        } else {
+            cfg.seed = chrono::system_clock::now().time_since_epoch().count();
+            cout << "Enter number of random points: ";
+            cin >> cfg.n;
         }
-        if ((static_cast<double>(rand()) / RAND_MAX) > 0.9) {
-            vy = (static_cast<double>(rand()) / RAND_MAX) * v_LIM;
-        }
-        fout << x << "," << y << "," << mass << "," << vx << "," << vy << "\n";
-    }
-
-cout<<"Random points written to random_coordinates.txt\n";
-    fout.close();
-}
 
+        auto start = chrono::high_resolution_clock::now();
+        ds::writeBodies(cfg, filename);
+        auto end = chrono::high_resolution_clock::now();
+        double secs = chrono::duration<double>(end - start).count();
 
-int main() {
-    srand(time(0));
-
-    string filename = "random_coordinates.txt";
-    int N;
-    cout << "Enter number of random points: ";
-    cin >> N;
-    generateRandomPoints(filename, N);
-
+        cout << "Random points written to " << filename << " (" << cfg.n << " bodies, "
+             << cfg.n / max(secs, 1e-9) / 1e6 << " M bodies/s)\n";
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
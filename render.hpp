@@ -0,0 +1,107 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cmath>
+#include <stdexcept>
+#include <filesystem>
+#include "ds.hpp"
+
+using namespace std;
+
+namespace ds {
+
+// PGM: one binary P5 file per frame in a directory.
+// RAW: one stream of width*height gray bytes per frame, e.g. for
+//      ffmpeg -f rawvideo -pix_fmt gray -s WxH -i frames.raw out.mp4
+enum class RasterFormat { PGM, RAW };
+
+// Splats particle mass into a 2D density image. Each thread accumulates into its own
+// buffer, buffers are summed row-parallel, then log-scaled into 8-bit pixels.
+class DensityRaster {
+private:
+    size_t width, height;
+    vector<vector<float>> tiles;
+    vector<float> density;
+    vector<unsigned char> pixels;
+
+public:
+    DensityRaster(size_t w = 512, size_t h = 512) : width(w), height(h) {
+        if (w == 0 || h == 0) throw invalid_argument("DensityRaster: empty image");
+    }
+
+    size_t getWidth() const { return width; }
+    size_t getHeight() const { return height; }
+    const vector<unsigned char>& image() const { return pixels; }
+
+    // extra, when given, is splatted as well (a simulation's static bodies; few, so serially)
+    void render(const ParticleVector& particles, const BoundingBox& view, unsigned threads,
+                const ParticleVector* extra = nullptr) {
+        threads = max(threads, 1u);
+        if (tiles.size() < threads) tiles.resize(threads);
+        for (auto& t : tiles) t.assign(width * height, 0.0f);
+
+        double ox = view.center.x - view.halfDim, oy = view.center.y - view.halfDim;
+        double sx = width / (2 * view.halfDim), sy = height / (2 * view.halfDim);
+        auto splat = [&](float* tile, const Particle& p) {
+            double fx = (p.pos.x - ox) * sx, fy = (p.pos.y - oy) * sy;
+            if (fx < 0 || fy < 0 || fx >= width || fy >= height) return;
+            // image rows run top to bottom, y up
+            size_t px = (size_t)fx, py = height - 1 - (size_t)fy;
+            tile[py * width + px] += (float)p.mass;
+        };
+        parallel_for(particles.size(), threads, [&](size_t b, size_t e, unsigned t) {
+            float* tile = tiles[t].data();
+            for (size_t i = b; i < e; ++i) splat(tile, particles[i]);
+        });
+        if (extra) {
+            for (const auto& p : *extra) splat(tiles[0].data(), p);
+        }
+
+        density.assign(width * height, 0.0f);
+        vector<float> rowMax(height, 0.0f), rowMin(height, INFINITY);
+        parallel_for(height, threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t y = b; y < e; ++y) {
+                for (size_t x = 0; x < width; ++x) {
+                    float sum = 0;
+                    for (unsigned t = 0; t < threads; ++t) sum += tiles[t][y * width + x];
+                    density[y * width + x] = sum;
+                    if (sum > 0) {
+                        rowMax[y] = max(rowMax[y], sum);
+                        rowMin[y] = min(rowMin[y], sum);
+                    }
+                }
+            }
+        }, 16);
+
+        float dMax = 0, dMin = INFINITY;
+        for (size_t y = 0; y < height; ++y) { dMax = max(dMax, rowMax[y]); dMin = min(dMin, rowMin[y]); }
+
+        // log scale so the lightest occupied pixel is just visible and the densest is white
+        pixels.assign(width * height, 0);
+        if (dMax <= 0) return;
+        double norm = log1p(dMax / dMin);
+        if (norm <= 0) norm = 1;
+        parallel_for(pixels.size(), threads, [&](size_t b, size_t e, unsigned) {
+            for (size_t i = b; i < e; ++i) {
+                if (density[i] <= 0) continue;
+                double v = log1p(density[i] / dMin) / norm;
+                pixels[i] = (unsigned char)(1 + v * 254);
+            }
+        });
+    }
+
+    void writePGM(const string& filename) const {
+        ofstream out(filename, ios::binary);
+        if (!out.is_open()) throw runtime_error("Cannot open " + filename);
+        out << "P5\n" << width << " " << height << "\n255\n";
+        out.write((const char*)pixels.data(), pixels.size());
+    }
+
+    void appendRaw(ofstream& out) const {
+        out.write((const char*)pixels.data(), pixels.size());
+    }
+};
+
+}
@@ -0,0 +1,1052 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include "ds.hpp"
+#include "pm.hpp"
+#include "neighbors.hpp"
+#include "kdtree.hpp"
+#include "render.hpp"
+#include "initial_conditions.hpp"
+#include "perf_counters.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+constexpr double G_CONST = 6.67430e-11;
+constexpr double COULOMB_K = 8.98755e9;
+
+// Conserved quantities, sampled before the integration of a step.
+struct Diagnostics {
+    long long step = -1;
+    double kinetic = 0;
+    double potential = NAN;     // NaN when the solver cannot supply it (TreePM); excludes
+                                // the constant energy between static bodies
+    double total = NAN;
+    double energyDrift = NAN;   // (E - E0) / |E0| against the first sample
+    ds::Vec2D<double> momentum;
+    double angularMomentum = 0; // about the origin
+    ds::Vec2D<double> centerOfMass; // moving bodies; static ones only add a constant
+
+    double comDrift = 0;        // |CoM - CoM0|
+};
+
+// Wall time of each phase of step(), in seconds.
+struct PhaseTimes {
+    double sort = 0;
+    double build = 0;     // bounds + tree
+    double force = 0;     // tree walk, plus the mesh in TreePM mode
+    double integrate = 0;
+    double forceIdle = 0; // mean time a force worker waited for the slowest one (not in total)
+
+    PhaseTimes& operator+= (const PhaseTimes& o) {
+        sort += o.sort; build += o.build; force += o.force; integrate += o.integrate;
+        forceIdle += o.forceIdle;
+        return *this;
+    }
+    double total() const { return sort + build + force + integrate; }
+};
+
+class Simulation {
+private:
+    ds::ParticleVector particles;
+    // the per-step tree, one of the two depending on treeType
+    unique_ptr<ds::BarnesHutTree> tree;
+    unique_ptr<ds::KdTree> kdTree;
+    ds::TreeType treeType;
+    ds::KdSplit kdSplit;
+    size_t kdLeafSize;
+    ds::InteractionCache listCache;
+    ds::HashTable<size_t, ds::Particle*> registry; // id -> body, dynamic and static
+    size_t nextId;      // id of the next added body
+    bool treeCurrent;   // false once the population changed after the last build
+    
+    double timeStep;
+    ds::BoundingBox boundaries;
+    ds::BoundingBox coreBounds; // robust core estimate, reference for the escape test
+    vector<double> coreScratch; // coordinates for its medians, reused every step
+    size_t escapers;
+    unsigned numThreads;
+    double theta;
+    ds::OpeningCriterion mac;
+    double macTolerance;
+    size_t interactions; // pair terms evaluated in the last step's walks
+
+    // Cost zones: the force walk runs over the tree-ordered bodies cut into spans of
+    // equal last-step interaction count, one per worker (off = equal counts, array order)
+    bool loadBalance;
+    vector<ds::Particle*> treeOrder;
+    vector<size_t> zoneBounds;
+    vector<double> workerBusy;
+
+    // Step-local buffers kept between steps, so a steady-state step does not allocate
+    ds::ParticleVector sortScratch;
+    ds::DynamicArray<ds::Particle*> jobs;
+    vector<size_t> pairCounts;
+    struct Extent {
+        double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+    };
+    vector<Extent> extentPartial; // per-worker bounds of updateBounds()
+
+    bool verbose;
+
+    // Periodic domain: boundaries is fixed and positions wrap into it
+    bool periodic;
+    ds::EwaldTable ewald;
+
+    // Bodies at or above staticMass (or flagged isStatic) leave particles at init and
+    // are served by a tree that is never rebuilt
+    double staticMass;
+    ds::StaticField statics;
+
+    ds::SolverType solver;
+    ds::ParticleMesh pm;
+    vector<ds::Vec2D<double>> meshForce;
+    ds::NeighborList neighbors;
+
+    // Bodies closer than captureRadius merge (0 = off), found with the tree's close-pair sweep
+    double captureRadius;
+    size_t mergers;
+    vector<pair<ds::Particle*, ds::Particle*>> closeBuf;
+    vector<char> absorbed;
+
+    // Level-of-detail output (lodDepth < 0 = off): tree aggregates instead of bodies,
+    // with a full-resolution frame every lodFullEvery frames (0 = never)
+    int lodDepth;
+    double lodMinCell;
+    int lodFullEvery;
+    vector<ds::NodeAggregate> lodNodes;
+
+    // Density frames rendered in-process every renderEvery steps (0 = off);
+    // the view is fixed at the first rendered frame so the camera does not jump
+    int renderEvery;
+    string renderPath;
+    ds::RasterFormat renderFormat;
+    ds::DensityRaster raster;
+    ds::BoundingBox renderView;
+    bool renderViewSet;
+    ofstream renderStream;
+    int framesRendered;
+
+    PhaseTimes phases, phaseTotals;
+
+    // Hardware counters per phase (sort, build, force, integrate) and parallel task, read
+    // from each thread's own ds::threadPerfCounters(). Row 0 also takes the serial work
+    // of the thread calling step(), whose counts inside tasks are kept in perfInTasks.
+    bool perfOn;
+    thread::id perfThread;
+    ds::PerfCounts perfLast, perfInTasks;
+    vector<vector<ds::PerfCounts>> perfTotals;
+
+    // On-the-fly diagnostics every diagEvery steps (0 = off)
+    int diagEvery;
+    long long stepCount;
+    vector<double> potentials;
+    Diagnostics diag, diagBaseline;
+
+    struct Sums { double ke = 0, pe = 0, px = 0, py = 0, L = 0, m = 0, mx = 0, my = 0; };
+    vector<Sums> diagPartial;
+
+    // Live metrics (off while metricsBoard is null): published at the end of every step,
+    // read by the server thread. The tree depth walks the quadtree, so it and the other
+    // tree numbers are refreshed once per steps/s window rather than every step.
+    unique_ptr<ds::MetricsBoard> metricsBoard;
+    unique_ptr<ds::MetricsServer> metricsServer;
+    ds::MetricsSample sample;
+    chrono::steady_clock::time_point rateStart;
+    long long rateSteps;
+    double outputLast, outputTotal;
+    size_t framesWritten;
+
+    // Force Config
+    double K_val;
+    double Dist_Pow;
+
+    ofstream dataFile;
+
+    // calls f with whichever tree is in use; both offer the calls the step makes
+    template<class F>
+    void withTree(F f) {
+        if (kdTree) f(*kdTree);
+        else f(*tree);
+    }
+
+    void makeTree() {
+        tree.reset();
+        kdTree.reset();
+        if (treeType == ds::TreeType::KD_TREE) kdTree = make_unique<ds::KdTree>(theta, kdSplit, kdLeafSize);
+        else tree = make_unique<ds::BarnesHutTree>(particles.size() * 2, theta);
+        withTree([&](auto& t) {
+            t.setOpeningCriterion(mac, macTolerance);
+            if (periodic) t.setPeriodic(boundaries.halfDim * 2.0, &ewald);
+        });
+        treeCurrent = false;
+        listCache.invalidate();
+    }
+
+    // cuts jobs into zoneBounds, one span per worker: equal cost, or equal counts
+    void buildZones(unsigned workers, bool byCost) {
+        size_t n = jobs.length();
+        zoneBounds.assign(workers + 1, n);
+        zoneBounds[0] = 0;
+        if (!byCost) {
+            size_t chunk = (n + workers - 1) / workers;
+            for (unsigned t = 1; t < workers; ++t) zoneBounds[t] = min(n, t * chunk);
+            return;
+        }
+        double total = 0;
+        for (size_t i = 0; i < n; ++i) total += jobs[i]->cost + 1.0;
+        double acc = 0;
+        unsigned t = 1;
+        for (size_t i = 0; i < n && t < workers; ++i) {
+            acc += jobs[i]->cost + 1.0;
+            while (t < workers && acc >= total * t / workers) zoneBounds[t++] = i + 1;
+        }
+    }
+
+    // Merges each captured pair into the heavier body (mass, momentum and CoM conserved),
+    // closest pairs first. An absorbed body is skipped for the rest of the sweep, but a
+    // survivor may absorb again, so chains merge in one sweep. Returns true if any merged.
+    bool mergeCaptured() {
+        withTree([&](auto& t) { t.closePairs(captureRadius, closeBuf, numThreads); });
+        if (closeBuf.empty()) return false;
+        auto dist2 = [](const pair<ds::Particle*, ds::Particle*>& pr) { return (pr.first->pos - pr.second->pos).magSq(); };
+        sort(closeBuf.begin(), closeBuf.end(), [&](const auto& a, const auto& b) {
+            double da = dist2(a), db = dist2(b);
+            return da < db || (da == db && a < b);
+        });
+
+        absorbed.assign(particles.size(), 0);
+        for (auto pr : closeBuf) {
+            ds::Particle* a = pr.first;
+            ds::Particle* b = pr.second;
+            if (absorbed[a - particles.data()] || absorbed[b - particles.data()]) continue;
+            if (b->mass > a->mass) swap(a, b);
+            double m = a->mass + b->mass;
+            a->pos = (a->pos * a->mass + b->pos * b->mass) / m;
+            a->vel = (a->vel * a->mass + b->vel * b->mass) / m;
+            a->mass = m;
+            absorbed[b - particles.data()] = 1;
+            ++mergers;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < particles.size(); ++i) {
+            if (absorbed[i]) registry.erase(particles[i].id);
+            else particles[kept++] = particles[i];
+        }
+        particles.resize(kept);
+        for (size_t i = 0; i < particles.size(); ++i) registry.insert(particles[i].id, &particles[i]);
+        return true;
+    }
+
+    void renderFrame() {
+        if (!renderViewSet) {
+            renderView = {boundaries.center, boundaries.halfDim * 1.1};
+            renderViewSet = true;
+        }
+        raster.render(particles, renderView, numThreads, statics.empty() ? nullptr : &statics.getBodies());
+        if (renderFormat == ds::RasterFormat::RAW) {
+            raster.appendRaw(renderStream);
+        } else {
+            char name[32];
+            snprintf(name, sizeof(name), "frame_%05d.pgm", framesRendered);
+            raster.writePGM((filesystem::path(renderPath) / name).string());
+        }
+        ++framesRendered;
+    }
+
+    void perfMark(int phase) {
+        if (!perfOn) return;
+        ds::PerfCounts now = ds::threadPerfCounters().read();
+        ds::PerfCounts serial = now - perfLast;
+        for (int e = 0; e < ds::PERF_EVENT_COUNT; ++e)
+            serial.value[e] -= min(serial.value[e], perfInTasks.value[e]);
+        perfTotals[phase][0] += serial;
+        perfLast = now;
+        perfInTasks = ds::PerfCounts();
+    }
+
+    // runs task t of a parallel phase, counting it when profiling is on
+    template<class F>
+    void countedWorker(int phase, unsigned t, F&& work) {
+        if (!perfOn) { work(); return; }
+        ds::PerfCounterSet& counters = ds::threadPerfCounters();
+        ds::PerfCounts start = counters.read();
+        work();
+        ds::PerfCounts spent = counters.read() - start;
+        perfTotals[phase][t] += spent;
+        if (this_thread::get_id() == perfThread) perfInTasks += spent;
+    }
+
+    void computeDiagnostics() {
+        vector<Sums>& partial = diagPartial;
+        partial.assign(numThreads, Sums());
+        ds::parallel_for(particles.size(), numThreads, [&](size_t b, size_t e, unsigned t) {
+            Sums acc;
+            for (size_t i = b; i < e; ++i) {
+                const auto& p = particles[i];
+                acc.ke += 0.5 * p.mass * p.vel.magSq();
+                acc.pe += potentials[i];
+                acc.px += p.mass * p.vel.x;
+                acc.py += p.mass * p.vel.y;
+                acc.L += p.mass * (p.pos.x * p.vel.y - p.pos.y * p.vel.x);
+                acc.m += p.mass;
+                acc.mx += p.mass * p.pos.x;
+                acc.my += p.mass * p.pos.y;
+            }
+            partial[t] = acc;
+        });
+        Sums tot;
+        for (const auto& ps : partial) {
+            tot.ke += ps.ke; tot.pe += ps.pe; tot.px += ps.px; tot.py += ps.py;
+            tot.L += ps.L; tot.m += ps.m; tot.mx += ps.mx; tot.my += ps.my;
+        }
+
+        diag.step = stepCount;
+        diag.kinetic = tot.ke;
+        diag.potential = 0.5 * tot.pe; // every pair was seen from both ends
+        diag.total = diag.kinetic + diag.potential;
+        diag.momentum = {tot.px, tot.py};
+        diag.angularMomentum = tot.L;
+        diag.centerOfMass = tot.m > 0 ? ds::Vec2D<double>(tot.mx / tot.m, tot.my / tot.m) : ds::Vec2D<double>(0.0, 0.0);
+        if (diagBaseline.step < 0) diagBaseline = diag;
+        diag.energyDrift = (diag.total - diagBaseline.total) / abs(diagBaseline.total);
+        diag.comDrift = (diag.centerOfMass - diagBaseline.centerOfMass).mag();
+
+        if (verbose) {
+            cout << "[Diag " << diag.step << "] E=" << diag.total << " (KE " << diag.kinetic << ", PE " << diag.potential
+                 << "), dE/E0=" << diag.energyDrift << ", P=" << diag.momentum << ", L=" << diag.angularMomentum
+                 << ", CoM drift=" << diag.comDrift << "\n";
+        }
+    }
+
+    void publishMetrics() {
+        if (!metricsBoard) return;
+        auto now = chrono::steady_clock::now();
+        double window = chrono::duration<double>(now - rateStart).count();
+        bool roll = window >= 1.0;
+        if ((roll || sample.stepsPerSecond == 0) && window > 0) {
+            sample.stepsPerSecond = (stepCount - rateSteps) / window;
+            if (solver != ds::SolverType::CELL_LIST && (tree || kdTree)) {
+                withTree([&](auto& t) {
+                    sample.treeNodes = t.nodeCount();
+                    sample.treeBytes = t.memoryUsed();
+                    sample.treeDepth = t.depth();
+                });
+            }
+        }
+        if (roll) {
+            rateStart = now;
+            rateSteps = stepCount;
+        }
+        sample.steps = stepCount;
+        sample.particles = particles.size();
+        double last[] = {phases.sort, phases.build, phases.force, phases.integrate, outputLast};
+        double total[] = {phaseTotals.sort, phaseTotals.build, phaseTotals.force, phaseTotals.integrate, outputTotal};
+        for (int i = 0; i < ds::METRIC_PHASES; ++i) {
+            sample.phase[i] = last[i];
+            sample.phaseTotal[i] = total[i];
+        }
+        sample.largeArrayBytes = ds::largeArrayBytesInUse().load(memory_order_relaxed);
+        sample.interactionsPerParticle = interactionsPerParticle();
+        sample.escapers = escapers;
+        sample.framesWritten = framesWritten;
+        sample.energyDrift = diag.energyDrift;
+        metricsBoard->publish(sample);
+    }
+
+public:
+    Simulation(): registry(1009) {
+        timeStep = 0.01;
+        boundaries = {ds::Vec2D(0.0,0.0), 1000};
+        coreBounds = boundaries;
+        K_val = 1.0;
+        Dist_Pow = 2.0;
+        escapers = 0;
+        nextId = 0;
+        treeCurrent = false;
+        numThreads = ds::hardwareThreads();
+        theta = ds::THETA_DEFAULT;
+        mac = ds::OpeningCriterion::GEOMETRIC;
+        macTolerance = 0;
+        interactions = 0;
+        loadBalance = true;
+        verbose = true;
+        periodic = false;
+        staticMass = INFINITY;
+        captureRadius = 0;
+        mergers = 0;
+        perfOn = false;
+        solver = ds::SolverType::BARNES_HUT;
+        treeType = ds::TreeType::QUADTREE;
+        kdSplit = ds::KdSplit::MEDIAN;
+        kdLeafSize = ds::KD_LEAF_SIZE;
+        diagEvery = 0;
+        stepCount = 0;
+        lodDepth = -1;
+        lodMinCell = 0;
+        lodFullEvery = 0;
+        renderEvery = 0;
+        renderFormat = ds::RasterFormat::PGM;
+        renderViewSet = false;
+        framesRendered = 0;
+        rateSteps = 0;
+        outputLast = outputTotal = 0;
+        framesWritten = 0;
+    }
+
+    // path is a directory for PGM frames or a file for the raw stream
+    void setRenderer(const string& path, size_t width, size_t height,
+                     ds::RasterFormat format = ds::RasterFormat::PGM, int every = 1) {
+        renderPath = path;
+        renderFormat = format;
+        renderEvery = max(every, 0);
+        raster = ds::DensityRaster(width, height);
+        renderViewSet = false;
+    }
+
+    void setRenderView(const ds::BoundingBox& view) {
+        renderView = view;
+        renderViewSet = true;
+    }
+
+    // LOD frames hold one "x, y, mass, cellSize" line per aggregate of the step's tree,
+    // i.e. positions from before that step's integration.
+    void setLevelOfDetail(int maxDepth, double minCellSize = 0, int fullEvery = 0) {
+        lodDepth = maxDepth;
+        lodMinCell = minCellSize;
+        lodFullEvery = max(fullEvery, 0);
+    }
+
+    // Potential is gathered in the force walk of every k-th step; 0 disables.
+    // Periodic runs report the minimum-image potential only.
+    void setDiagnostics(int everyK) { diagEvery = max(everyK, 0); }
+    const Diagnostics& lastDiagnostics() const { return diag; }
+
+    // Returns false (and stays a no-op) when perf_event_open is unavailable.
+    bool enablePerfCounters() {
+        if (!ds::threadPerfCounters().available()) return false;
+        perfOn = true;
+        perfTotals.assign(4, vector<ds::PerfCounts>(numThreads));
+        return true;
+    }
+
+    void printPerfReport(ostream& os) const {
+        if (!perfOn) {
+            os << "Hardware counters unavailable.\n";
+            return;
+        }
+        const char* names[] = {"sort", "build", "force", "integrate"};
+        double secs[] = {phaseTotals.sort, phaseTotals.build, phaseTotals.force, phaseTotals.integrate};
+        ds::printPerfTable(os, names, secs, perfTotals);
+    }
+
+    // Serves live metrics as Prometheus text at endpoint, see ds::MetricsServer, and returns
+    // the address actually bound. Publishing costs one sequence-locked copy per step, the
+    // server thread never blocks the stepping thread. Energy drift needs setDiagnostics.
+    // An empty endpoint stops the server.
+    string enableMetrics(const string& endpoint) {
+        metricsServer.reset();
+        if (endpoint.empty()) {
+            metricsBoard.reset();
+            return "";
+        }
+        if (!metricsBoard) {
+            metricsBoard = make_unique<ds::MetricsBoard>();
+            sample = ds::MetricsSample();
+            rateStart = chrono::steady_clock::now();
+            rateSteps = stepCount;
+        }
+        metricsServer = make_unique<ds::MetricsServer>(*metricsBoard, endpoint);
+        return metricsServer->address();
+    }
+    const ds::MetricsBoard* getMetrics() const { return metricsBoard.get(); }
+
+    const PhaseTimes& lastPhases() const { return phases; }
+    const PhaseTimes& totalPhases() const { return phaseTotals; }
+    long long stepsTaken() const { return stepCount; }
+
+    // Call before init*; bodies this heavy are pinned in place
+    void setStaticMass(double m) { staticMass = m; }
+    const ds::ParticleVector& getStaticBodies() const { return statics.getBodies(); }
+
+    // Tree solvers only; static bodies neither capture nor get captured
+    // Not with periodic boundaries: the close-pair sweep does not look across the wrap
+    void setCaptureRadius(double r) {
+        if (r > 0 && periodic) throw invalid_argument("Capture merging only supports open boundaries");
+        captureRadius = max(r, 0.0);
+    }
+    size_t mergerCount() const { return mergers; }
+    // the tree of the last step, for spatial queries; nullptr before the first step and
+    // after bodies were added or removed, until the next step rebuilds it, and while the
+    // k-d tree is in use (see getKdTree)
+    const ds::BarnesHutTree* getTree() const { return treeCurrent ? tree.get() : nullptr; }
+    const ds::KdTree* getKdTree() const { return treeCurrent ? kdTree.get() : nullptr; }
+
+    // Tree of the tree solvers (Barnes-Hut and the short-range part of TreePM). The
+    // k-d tree suits thin disks and filaments, see kdtree.hpp. May be called at any time.
+    void setTreeType(ds::TreeType t, ds::KdSplit rule = ds::KdSplit::MEDIAN, size_t leafSize = ds::KD_LEAF_SIZE) {
+        if (t != ds::TreeType::KD_TREE && listCache.enabled())
+            throw invalid_argument("Interaction-list caching needs the k-d tree");
+        treeType = t;
+        kdSplit = rule;
+        kdLeafSize = leafSize;
+        if (tree || kdTree) makeTree();
+    }
+
+    // Keeps each body's interaction list for several steps, see ds::InteractionCache: lists
+    // are walked again once bodies moved more than skin, and the tree is rebuilt once more
+    // than rebuildFraction of the bodies did. Needs the k-d tree, the Barnes-Hut solver and
+    // open boundaries; skin <= 0 turns it off.
+    void setInteractionCache(double skin, double rebuildFraction = 0.1) {
+        if (skin > 0 && (treeType != ds::TreeType::KD_TREE || solver != ds::SolverType::BARNES_HUT || periodic))
+            throw invalid_argument("Interaction-list caching needs the k-d tree, the Barnes-Hut solver and open boundaries");
+        listCache.setSkin(skin, rebuildFraction);
+    }
+    const ds::ListCacheStats& listCacheStats() const { return listCache.getStats(); }
+
+    // Short-range engine: forces beyond cutoff are dropped, lists cover cutoff + skin
+    void setCutoff(double cutoff, double skin) { neighbors.setCutoff(cutoff, skin); }
+    size_t neighborRebuilds() const { return neighbors.rebuildCount(); }
+
+    void setSolver(ds::SolverType s) {
+        if (s == ds::SolverType::TREE_PM && periodic)
+            throw invalid_argument("TreePM mesh only supports open boundaries");
+        if (s == ds::SolverType::CELL_LIST && neighbors.getCutoff() <= 0)
+            throw invalid_argument("Cell-list solver needs setCutoff first");
+        if (s != ds::SolverType::BARNES_HUT && listCache.enabled())
+            throw invalid_argument("Interaction-list caching needs the Barnes-Hut solver");
+        solver = s;
+        if (s != ds::SolverType::TREE_PM && (tree || kdTree)) withTree([](auto& t) { t.setShortRange(nullptr); });
+    }
+
+    // Before or after init*: the Ewald table depends on the distance power, so init*
+    // rebuilds it and wraps the bodies it brings
+    void enablePeriodic(double boxSize, ds::Vec2D<double> center = {0.0, 0.0}) {
+        if (boxSize <= 0) throw invalid_argument("Periodic box size must be positive");
+        // the image sum only converges for a law falling faster than 1/r
+        if (Dist_Pow <= 1) throw invalid_argument("Periodic boundaries need a distance power above 1");
+        if (solver == ds::SolverType::TREE_PM)
+            throw invalid_argument("TreePM mesh only supports open boundaries");
+        if (listCache.enabled()) throw invalid_argument("Interaction-list caching only supports open boundaries");
+        if (captureRadius > 0) throw invalid_argument("Capture merging only supports open boundaries");
+        periodic = true;
+        boundaries = {center, boxSize / 2.0};
+        ewald.build(boxSize, Dist_Pow);
+        if (tree || kdTree) withTree([&](auto& t) { t.setPeriodic(boxSize, &ewald); });
+        neighbors.setPeriodic(boxSize, center - ds::Vec2D<double>(boxSize / 2.0, boxSize / 2.0));
+        wrapPositions();
+        if (!statics.empty()) {
+            wrapPositions(statics.getBodies());
+            statics.build(theta, boxSize, &ewald);
+        }
+    }
+
+    void wrapPositions() { wrapPositions(particles); }
+
+    void wrapPositions(ds::ParticleVector& bodies) {
+        for (auto& p : bodies) wrapPosition(p);
+    }
+
+    void wrapPosition(ds::Particle& p) const {
+        double L = boundaries.halfDim * 2.0;
+        double lo_x = boundaries.center.x - boundaries.halfDim, lo_y = boundaries.center.y - boundaries.halfDim;
+        double x = fmod(p.pos.x - lo_x, L), y = fmod(p.pos.y - lo_y, L);
+        if (x < 0) x += L;
+        if (y < 0) y += L;
+        // fmod can round up onto the open edge
+        if (x >= L) x = 0;
+        if (y >= L) y = 0;
+        p.pos = {lo_x + x, lo_y + y};
+    }
+
+    void setTimeStep(double dt) { timeStep = dt; }
+    void setTheta(double t) { theta = t; }
+
+    // see ds::OpeningCriterion for the meaning of tolerance
+    void setOpeningCriterion(ds::OpeningCriterion c, double tolerance = 0) {
+        if (tree || kdTree) withTree([&](auto& t) { t.setOpeningCriterion(c, tolerance); });
+        mac = c;
+        macTolerance = tolerance;
+    }
+
+    void setLoadBalance(bool on) { loadBalance = on; }
+
+    double interactionsPerParticle() const {
+        return particles.empty() ? 0.0 : (double)interactions / particles.size();
+    }
+    void setThreads(unsigned n) { numThreads = max(n, 1u); }
+    void setVerbose(bool v) { verbose = v; }
+    size_t size() const { return particles.size() + statics.size(); }
+
+    void initFromFile(const string& filename, double k, double pow) {
+        K_val = k;
+        Dist_Pow = pow;
+        particles.clear();
+        particles.reserve(1000);
+
+        ifstream infile(filename);
+        if (!infile.is_open()) throw runtime_error("File error");
+
+        string line;
+        int idCounter = 0;
+        if (ds::isBinaryBodyFile(filename)) {
+            infile.close();
+            vector<ds::BodyRecord> bodies = ds::readBinaryBodies(filename);
+            particles.reserve(bodies.size());
+            for (const auto& b : bodies) {
+                ds::Particle p;
+                p.id = idCounter++;
+                p.pos = {b.x, b.y};
+                p.mass = b.m;
+                p.vel = {b.vx, b.vy};
+                particles.push_back(p);
+            }
+        } else {
+            while (getline(infile, line)) {
+                if (line.empty()) continue;
+                stringstream ss(line);
+                double x, y, m, vx, vy;
+                char c1, c2, c3, c4; // eat commas
+
+                if (ss >> x >> c1 >> y >> c2 >> m >> c3 >> vx >> c4 >> vy) {
+                    ds::Particle p;
+                    p.id = idCounter++;
+                    p.pos = {x, y};
+                    p.mass = m;
+                    p.vel = {vx, vy}; 
+                    p.acc = {0.0, 0.0};
+                    particles.push_back(p);
+                }
+            }
+        }
+
+        initTrees();
+    }
+
+    void initFromParticles(const ds::ParticleVector& src, double k, double pow) {
+        K_val = k;
+        Dist_Pow = pow;
+        particles = src;
+        initTrees();
+    }
+
+    const ds::ParticleVector& getParticles() const { return particles; }
+
+    void initFromManual(int n, double k, double pow) {
+        K_val = k;
+        Dist_Pow = pow;
+        particles.clear();
+        cout << "Enter " << n << " particles (x, y, mass):\n";
+        for(int i=0; i<n; ++i) {
+            double x, y, m;
+            cout << "P" << i << ": "; cin >> x >> y >> m;
+            ds::Particle p;
+            p.id = i; p.pos = {x, y}; p.mass = m;
+            p.vel = {0.0,0.0}; p.acc = {0.0,0.0}; p.isStatic = false;
+            particles.push_back(p);
+        }
+        initTrees();
+    }
+
+    // Moves the static bodies into their own tree, registers everything and sets up
+    // the per-step tree for the rest
+    void initTrees() {
+        if (periodic) {
+            if (Dist_Pow <= 1) throw invalid_argument("Periodic boundaries need a distance power above 1");
+            ewald.build(boundaries.halfDim * 2.0, Dist_Pow);
+            wrapPositions();
+        }
+        ds::ParticleVector fixed;
+        size_t kept = 0;
+        for (auto& p : particles) {
+            p.isStatic = p.isStatic || p.mass >= staticMass;
+            if (p.isStatic) fixed.push_back(p);
+            else particles[kept++] = p;
+        }
+        particles.resize(kept);
+        statics.assign(std::move(fixed));
+        statics.build(theta, periodic ? boundaries.halfDim * 2.0 : 0.0, &ewald);
+
+        registry.clear();
+        nextId = 0;
+        for (size_t i = 0; i < particles.size(); i++) {
+            registry.insert(particles[i].id, &particles[i]);
+            nextId = max(nextId, particles[i].id + 1);
+        }
+        for (auto& p : statics.getBodies()) {
+            registry.insert(p.id, &p);
+            nextId = max(nextId, p.id + 1);
+        }
+        neighbors.invalidate();
+        treeCurrent = false;
+
+        makeTree();
+        updateBounds();
+    }
+
+    // Between steps: appends bodies, assigning ids from nextId in order, and returns the
+    // first id. Static bodies (flagged, or at staticMass) join the static field, small
+    // batches in place. The store grows geometrically, see reserve().
+    size_t addParticles(const ds::ParticleVector& batch) {
+        size_t first = nextId;
+        ds::ParticleVector fixed;
+        const ds::Particle* oldData = particles.data();
+        size_t start = particles.size(), oldSize = start;
+        for (ds::Particle p : batch) {
+            p.id = nextId++;
+            p.acc = {0.0, 0.0};
+            p.cost = 0;
+            p.isStatic = p.isStatic || p.mass >= staticMass;
+            if (periodic) wrapPosition(p);
+            if (p.isStatic) fixed.push_back(p);
+            else particles.push_back(p);
+        }
+        // a reallocation moved everyone, otherwise only the new bodies need entries
+        if (particles.data() != oldData) start = 0;
+        for (size_t i = start; i < particles.size(); ++i) registry.insert(particles[i].id, &particles[i]);
+        if (!fixed.empty()) {
+            const ds::Particle* oldStatic = statics.getBodies().data();
+            size_t staticStart = statics.size();
+            statics.add(fixed);
+            ds::ParticleVector& all = statics.getBodies();
+            if (all.data() != oldStatic) staticStart = 0;
+            for (size_t i = staticStart; i < all.size(); ++i) registry.insert(all[i].id, &all[i]);
+        }
+        if (particles.size() != oldSize) {
+            neighbors.invalidate();
+            treeCurrent = false;
+        }
+        return first;
+    }
+
+    // Removes the bodies with these ids (unknown ids are skipped), each in O(1): the last
+    // body of the store moves into the freed slot. Returns how many were removed.
+    size_t removeParticles(const vector<size_t>& ids) {
+        size_t removed = 0;
+        bool movingChanged = false;
+        for (size_t id : ids) {
+            ds::Particle** slot = registry.find(id);
+            if (!slot) continue;
+            ds::Particle* p = *slot;
+            if (p->isStatic) {
+                const ds::Particle* oldStatic = statics.getBodies().data();
+                size_t i = p - oldStatic;
+                statics.removeAt(i);
+                ds::ParticleVector& all = statics.getBodies();
+                if (all.data() != oldStatic) {
+                    // a fallback rebuild moved the static store
+                    for (auto& q : all) registry.insert(q.id, &q);
+                } else if (i < all.size()) {
+                    registry.insert(all[i].id, &all[i]);
+                }
+            } else {
+                size_t i = p - particles.data();
+                if (i + 1 != particles.size()) {
+                    particles[i] = particles.back();
+                    registry.insert(particles[i].id, &particles[i]);
+                }
+                particles.pop_back();
+                movingChanged = true;
+            }
+            registry.erase(id);
+            ++removed;
+        }
+        if (movingChanged) {
+            neighbors.invalidate();
+            treeCurrent = false;
+        }
+        return removed;
+    }
+
+    // The body with this id, moving or static, or nullptr once it was removed or merged.
+    // Bodies move in memory on steps and edits, so look them up again afterwards.
+    const ds::Particle* findParticle(size_t id) const {
+        ds::Particle* const* slot = registry.find(id);
+        return slot ? *slot : nullptr;
+    }
+
+    // Room for n moving bodies, so later addParticles calls do not reallocate
+    void reserve(size_t n) {
+        if (n <= particles.capacity()) return;
+        particles.reserve(n);
+        for (size_t i = 0; i < particles.size(); ++i) registry.insert(particles[i].id, &particles[i]);
+        treeCurrent = false;
+    }
+
+    // Robust estimate of the core: median centre, 90th percentile Chebyshev radius.
+    // Redone every step, so a body receding from the core is never part of the
+    // reference, however far the last tight box reached.
+    void updateCoreBounds() {
+        if (particles.empty()) return;
+        size_t n = particles.size();
+        vector<double>& v = coreScratch;
+        v.resize(n);
+        for (size_t i = 0; i < n; ++i) v[i] = particles[i].pos.x;
+        nth_element(v.begin(), v.begin() + n/2, v.end());
+        double cx = v[n/2];
+        for (size_t i = 0; i < n; ++i) v[i] = particles[i].pos.y;
+        nth_element(v.begin(), v.begin() + n/2, v.end());
+        ds::Vec2D<double> c(cx, v[n/2]);
+        for (size_t i = 0; i < n; ++i) {
+            v[i] = max(abs(particles[i].pos.x - c.x), abs(particles[i].pos.y - c.y));
+        }
+        size_t q = (n * 9) / 10;
+        nth_element(v.begin(), v.begin() + q, v.end());
+        coreBounds = {c, max(v[q], 1.0)};
+    }
+
+    // Tight square root box around the non-escaping bodies (parallel min/max reduction).
+    void updateBounds() {
+        if (periodic) return;
+        updateCoreBounds();
+        vector<Extent>& partial = extentPartial;
+        partial.assign(numThreads, Extent());
+        const ds::BoundingBox ref = coreBounds;
+        const double escapeDist = ds::ESCAPE_FACTOR * ref.halfDim;
+
+        ds::parallel_for(particles.size(), numThreads, [&](size_t b, size_t e, unsigned t) {
+            Extent ext;
+            for (size_t i = b; i < e; ++i) {
+                const auto& pos = particles[i].pos;
+                if (max(abs(pos.x - ref.center.x), abs(pos.y - ref.center.y)) > escapeDist) continue;
+                ext.minX = min(ext.minX, pos.x); ext.maxX = max(ext.maxX, pos.x);
+                ext.minY = min(ext.minY, pos.y); ext.maxY = max(ext.maxY, pos.y);
+            }
+            partial[t] = ext;
+        });
+
+        Extent ext;
+        for (const auto& pe : partial) {
+            ext.minX = min(ext.minX, pe.minX); ext.maxX = max(ext.maxX, pe.maxX);
+            ext.minY = min(ext.minY, pe.minY); ext.maxY = max(ext.maxY, pe.maxY);
+        }
+        if (ext.minX > ext.maxX) return; // everything escaped, keep the old box
+
+        double half = max(ext.maxX - ext.minX, ext.maxY - ext.minY) * 0.5;
+        boundaries.center = {(ext.minX + ext.maxX) * 0.5, (ext.minY + ext.maxY) * 0.5};
+        // contains() is half-open, pad so the max-coordinate body still lands inside
+        boundaries.halfDim = max(half * (1.0 + 1e-6), ds::SOFTENING);
+    }
+
+    size_t escaperCount() const { return escapers; }
+
+    void step() {
+        using clock = chrono::steady_clock;
+        auto t0 = clock::now();
+        if (perfOn) {
+            for (auto& row : perfTotals) row.resize(max<size_t>(row.size(), numThreads));
+            perfThread = this_thread::get_id();
+            perfLast = ds::threadPerfCounters().read();
+            perfInTasks = ds::PerfCounts();
+        }
+
+        // the cell-list engine keeps body order, its lists index into particles
+        bool shortRange = solver == ds::SolverType::CELL_LIST;
+        // cached lists index the bodies, so a step reusing them keeps their order
+        bool cached = listCache.enabled() && !shortRange;
+        bool reuse = cached && treeCurrent && listCache.usable(particles, numThreads);
+        if (!shortRange && !reuse) {
+            auto cmp = [](const ds::Particle& a, const ds::Particle& b) {
+                return a.pos.x < b.pos.x;
+            };
+            ds::merge_sort(particles.begin(), particles.end(), cmp, sortScratch);
+
+            for(size_t i=0; i<particles.size(); ++i) {
+                registry.insert(particles[i].id, &particles[i]); 
+            }
+        }
+        perfMark(0);
+        auto t1 = clock::now();
+
+        if (shortRange) {
+            if (neighbors.needsRebuild(particles, numThreads)) neighbors.build(particles, numThreads);
+            escapers = 0;
+        } else {
+            // tree init; a step reusing cached lists only refits the aggregates
+            if (reuse) {
+                kdTree->refit();
+                listCache.refitted(*kdTree, particles);
+            } else {
+                updateBounds();
+                withTree([&](auto& t) { t.build(particles, boundaries); });
+            }
+            if (captureRadius > 0 && mergeCaptured()) {
+                reuse = false;
+                updateBounds();
+                withTree([&](auto& t) { t.build(particles, boundaries); });
+            }
+            if (cached && !reuse) listCache.rebuilt(particles);
+            withTree([&](auto& t) { escapers = t.outlierCount(); });
+            treeCurrent = true;
+        }
+        perfMark(1);
+        auto t2 = clock::now();
+
+        if (solver == ds::SolverType::TREE_PM) {
+            size_t g = ds::ParticleMesh::gridFor(particles.size());
+            if (pm.gridSize() != g) pm = ds::ParticleMesh(g);
+            pm.ensureCovers(boundaries, Dist_Pow);
+            withTree([&](auto& t) { t.setShortRange(&pm.forceSplit()); });
+            pm.compute(particles, boundaries, meshForce, numThreads);
+        }
+
+        bool wantDiag = diagEvery > 0 && stepCount % diagEvery == 0;
+        if (wantDiag) potentials.assign(particles.size(), 0.0);
+
+        if (shortRange) neighbors.compute(particles, K_val, Dist_Pow, wantDiag ? &potentials : nullptr, numThreads);
+
+        bool balance = loadBalance && !shortRange;
+        jobs.clear();
+        jobs.reserve(particles.size());
+        if (balance) {
+            withTree([&](auto& t) { t.collectBodies(treeOrder); });
+            for (ds::Particle* p : treeOrder) jobs.push(p);
+        } else {
+            for (auto& p: particles) jobs.push(&p);
+        }
+
+        unsigned workers = (unsigned)min<size_t>(numThreads, max<size_t>(jobs.length() / 256, 1));
+        buildZones(workers, balance);
+        workerBusy.assign(workers, 0.0);
+        pairCounts.assign(workers, 0);
+        ds::parallel_zones(zoneBounds, [&](size_t b, size_t e, unsigned t) {
+            auto busyStart = clock::now();
+            countedWorker(2, t, [&] {
+                size_t walkPairs = 0;
+                for (size_t i = b; i < e; ++i) {
+                    ds::Particle* p = jobs[i];
+                    double* phi = wantDiag ? &potentials[p - particles.data()] : nullptr;
+                    ds::Vec2D<double> force(0.0, 0.0);
+                    if (!shortRange) {
+                        size_t pairs = 0;
+                        if (cached) force = listCache.forceOn(*kdTree, particles, p - particles.data(), K_val, Dist_Pow, phi, &pairs);
+                        else withTree([&](auto& t) { force = t.getForceOn(p, K_val, Dist_Pow, phi, &pairs); });
+                        walkPairs += pairs;
+                        p->cost = (uint32_t)min<size_t>(pairs, UINT32_MAX);
+                    }
+                    if (!statics.empty()) {
+                        double staticPhi = 0;
+                        force += statics.forceOn(p, K_val, Dist_Pow, phi ? &staticPhi : nullptr);
+                        // seen from the moving end only, counted twice against the pair halving
+                        if (phi) *phi += 2.0 * staticPhi;
+                    }
+                    if (solver == ds::SolverType::TREE_PM) force += meshForce[p - particles.data()] * (K_val * p->mass);
+                    if (shortRange) p->acc += force / p->mass;
+                    else p->acc = force / p->mass;
+                }
+                pairCounts[t] += walkPairs;
+            });
+            workerBusy[t] = chrono::duration<double>(clock::now() - busyStart).count();
+        });
+        double slowest = *max_element(workerBusy.begin(), workerBusy.end()), idle = 0;
+        for (double w : workerBusy) idle += slowest - w;
+        phases.forceIdle = idle / workers;
+        interactions = shortRange ? neighbors.pairCount() : 0;
+        for (size_t c : pairCounts) interactions += c;
+        if (cached) listCache.countStep();
+        if (wantDiag) computeDiagnostics();
+        perfMark(2);
+        auto t3 = clock::now();
+
+        ds::parallel_for(jobs.length(), numThreads, [&](size_t b, size_t e, unsigned t) {
+            countedWorker(3, t, [&] {
+                for (size_t i = b; i < e; ++i) {
+                    ds::Particle* p = jobs[i];
+                    p->vel += p->acc * timeStep;
+                    p->pos += p->vel * timeStep;
+                }
+            });
+        });
+        if (periodic) wrapPositions();
+        ++stepCount;
+        perfMark(3);
+        auto t4 = clock::now();
+
+        phases.sort = chrono::duration<double>(t1 - t0).count();
+        phases.build = chrono::duration<double>(t2 - t1).count();
+        phases.force = chrono::duration<double>(t3 - t2).count();
+        phases.integrate = chrono::duration<double>(t4 - t3).count();
+        phaseTotals += phases;
+        publishMetrics();
+    }
+
+    void run(int steps, const string& filename) {
+        dataFile.open(filename);
+        if(!dataFile.is_open()) throw runtime_error("Cannot open file");
+        
+        if (verbose) cout << "Starting Simulation: " << steps << " steps.\n";
+        
+        if (renderEvery > 0) {
+            framesRendered = 0;
+            if (renderFormat == ds::RasterFormat::RAW) {
+                renderStream.open(renderPath, ios::binary);
+                if (!renderStream.is_open()) throw runtime_error("Cannot open " + renderPath);
+            } else {
+                filesystem::create_directories(renderPath);
+            }
+        }
+
+        size_t lastEscapers = 0, lastMergers = mergers;
+        int MOD = max(steps/10, 1);
+        for(int i=0; i<steps; i++) {
+            step();
+            if (verbose && escapers != lastEscapers) {
+                cout << "[Step " << i << "] Escapers: " << escapers << "\n";
+                lastEscapers = escapers;
+            }
+            if (verbose && mergers != lastMergers) {
+                cout << "[Step " << i << "] Mergers: " << mergers << ", bodies left: " << particles.size() << "\n";
+                lastMergers = mergers;
+            }
+            auto outputStart = chrono::steady_clock::now();
+            bool fullFrame = lodDepth < 0 || (lodFullEvery > 0 && i % lodFullEvery == 0) ||
+                             solver == ds::SolverType::CELL_LIST; // no tree to aggregate
+            if (fullFrame) {
+                for(size_t j=0; j<particles.size(); ++j) {
+                    dataFile << particles[j].pos.x << ", " << particles[j].pos.y  <<  ", " << particles[j].mass << "\n";
+                }
+                for (const auto& b : statics.getBodies()) {
+                    dataFile << b.pos.x << ", " << b.pos.y << ", " << b.mass << "\n";
+                }
+            } else {
+                withTree([&](auto& t) { t.collectAggregates(lodDepth, lodMinCell, lodNodes); });
+                for (const auto& a : lodNodes) {
+                    dataFile << a.centerOfMass.x << ", " << a.centerOfMass.y << ", " << a.totalMass << ", " << a.size << "\n";
+                }
+                for (const auto& b : statics.getBodies()) {
+                    dataFile << b.pos.x << ", " << b.pos.y << ", " << b.mass << ", 0\n";
+                }
+            }
+            dataFile << "\n\n";
+            if (renderEvery > 0 && i % renderEvery == 0) renderFrame();
+            outputLast = chrono::duration<double>(chrono::steady_clock::now() - outputStart).count();
+            outputTotal += outputLast;
+            ++framesWritten;
+            publishMetrics();
+            if (verbose && i % MOD == 0){
+                cout << "Step " << i << " complete.\n";
+                ds::Particle** watchedParticle = registry.find(0);
+                if (watchedParticle)
+                    cout << "[Step " << i << "] Particle #0 Pos: " << (*watchedParticle)->pos << ", escapers: " << escapers << "\n";
+            }
+        }
+        dataFile.close();
+        if (renderStream.is_open()) renderStream.close();
+        if (verbose && perfOn) printPerfReport(cout);
+        if (verbose && listCache.enabled()) {
+            const ds::ListCacheStats& st = listCache.getStats();
+            cout << "Interaction lists: " << st.rebuilds << " rebuilds, " << st.walks << " walks, "
+                 << st.reused << " reused (" << st.skippedFraction() * 100 << "% of walks skipped)\n";
+        }
+        if (verbose) cout << "Done.\n";
+    }
+};
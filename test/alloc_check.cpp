@@ -0,0 +1,213 @@
+// Counts heap allocations: the ds containers must reuse their storage, and a
+// steady-state Simulation::step must not allocate at all, for every solver and tree.
+//   g++ -std=c++17 -O2 -pthread alloc_check.cpp -o alloc_check
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "../simulation.hpp"
+
+using namespace std;
+
+static atomic<size_t> allocations(0);
+
+// replacement operators pair malloc with free; GCC cannot see that and warns
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t n) {
+    ++allocations;
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+template<class F>
+size_t countAllocations(F f) {
+    size_t before = allocations;
+    f();
+    return allocations - before;
+}
+
+void testContainers() {
+    cout << "[Running container reuse test]..." << endl;
+
+    // move-only elements go through push, resize and moves of the whole array
+    ds::DynamicArray<unique_ptr<int>> owned(1);
+    for (int i = 0; i < 10; ++i) owned.push(make_unique<int>(i));
+    assert(*owned.get(9) == 9);
+    ds::DynamicArray<unique_ptr<int>> moved(std::move(owned));
+    assert(moved.length() == 10 && owned.length() == 0);
+    assert(*moved[3] == 3);
+
+    ds::DynamicArray<int> arr;
+    arr.reserve(1000);
+    assert(countAllocations([&] {
+        for (int round = 0; round < 3; ++round) {
+            arr.clear();
+            for (int i = 0; i < 1000; ++i) arr.push(i);
+        }
+    }) == 0);
+    int sum = 0;
+    for (int v : arr) sum += v;
+    assert(sum == 999 * 1000 / 2);
+
+    ds::Stack<int> st(4);
+    ds::Queue<int> q(4);
+    st.reserve(64);
+    q.reserve(64);
+    assert(countAllocations([&] {
+        for (int i = 0; i < 64; ++i) { st.push(i); q.enqueue(i); }
+        st.top() = 100;
+        assert(st.top() == 100 && q.front() == 0);
+        st.clear();
+        q.clear();
+    }) == 0);
+    assert(st.empty() && q.empty());
+
+    // merge_sort with a kept scratch buffer: stable, and no allocation once it is sized
+    vector<pair<int, int>> v;
+    for (int i = 0; i < 5000; ++i) v.push_back({(i * 7919) % 97, i});
+    vector<pair<int, int>> scratch;
+    auto byKey = [](const pair<int, int>& a, const pair<int, int>& b) { return a.first < b.first; };
+    ds::merge_sort(v.begin(), v.end(), byKey, scratch);
+    for (size_t i = 1; i < v.size(); ++i) {
+        assert(v[i - 1].first < v[i].first || (v[i - 1].first == v[i].first && v[i - 1].second < v[i].second));
+    }
+    for (auto& e : v) e.first = (e.second * 31) % 89;
+    assert(countAllocations([&] { ds::merge_sort(v.begin(), v.end(), byKey, scratch); }) == 0);
+    for (size_t i = 1; i < v.size(); ++i) assert(v[i - 1].first <= v[i].first);
+
+#ifdef __linux__
+    // large arrays are mapped, on a 2 MiB boundary, and freed back to the counter
+    {
+        size_t held = ds::largeArrayBytesInUse();
+        ds::LargeArrayAllocator<double> big;
+        size_t n = (3 * ds::LARGE_ARRAY_BYTES) / sizeof(double);
+        double* p = nullptr;
+        assert(countAllocations([&] { p = big.allocate(n); }) == 0);
+        assert(reinterpret_cast<uintptr_t>(p) % ds::HUGE_PAGE_SIZE == 0);
+        p[0] = 1.0;
+        p[n - 1] = 2.0;
+        assert(ds::largeArrayBytesInUse() == held + ds::largeArrayLength(n * sizeof(double)));
+        big.deallocate(p, n);
+        assert(ds::largeArrayBytesInUse() == held);
+    }
+#endif
+
+    cout << "PASSED" << endl;
+}
+
+// warm-up steps size every buffer, after that a step must not allocate
+void checkSteadyState(const char* name, Simulation& sim) {
+    for (int i = 0; i < 3; ++i) sim.step();
+    size_t n = countAllocations([&] {
+        for (int i = 0; i < 5; ++i) sim.step();
+    });
+    cout << "  " << name << ": " << n << " allocations in 5 steps" << endl;
+    assert(n == 0);
+}
+
+void testSteadyStep() {
+    cout << "[Running steady-state step test]..." << endl;
+    ds::GeneratorConfig cfg;
+    cfg.dist = ds::Distribution::PLUMMER;
+    cfg.n = 20000;
+    cfg.seed = 5;
+    ds::ParticleVector bodies = ds::generateParticles(cfg, 1);
+
+    {
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(1);
+        sim.setTimeStep(1e-4);
+        sim.initFromParticles(bodies, 1.0, 2.0);
+        checkSteadyState("barnes-hut", sim);
+    }
+    {
+        // the parallel phases run on the shared pool, whose workers start in warm-up
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(4);
+        sim.setTimeStep(1e-4);
+        sim.initFromParticles(bodies, 1.0, 2.0);
+        checkSteadyState("barnes-hut, 4 threads", sim);
+    }
+    {
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(1);
+        sim.setTimeStep(1e-4);
+        sim.setLoadBalance(false);
+        sim.setDiagnostics(1);
+        sim.setOpeningCriterion(ds::OpeningCriterion::RELATIVE, 0.01);
+        sim.initFromParticles(bodies, 1.0, 2.0);
+        checkSteadyState("diagnostics + relative criterion", sim);
+    }
+    {
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(1);
+        sim.setTimeStep(1e-4);
+        sim.setSolver(ds::SolverType::TREE_PM);
+        sim.initFromParticles(bodies, 1.0, 2.0);
+        checkSteadyState("treepm", sim);
+    }
+    {
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(1);
+        sim.setTimeStep(1e-4);
+        sim.setTreeType(ds::TreeType::KD_TREE);
+        sim.initFromParticles(bodies, 1.0, 2.0);
+        checkSteadyState("k-d tree", sim);
+    }
+    {
+        // short steps, as the cache is meant for: most bodies sum their kept lists and the
+        // ones that walk again record into the storage of their earlier walks
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(1);
+        sim.setTimeStep(1e-5);
+        sim.setTreeType(ds::TreeType::KD_TREE);
+        sim.setInteractionCache(0.05);
+        sim.initFromParticles(bodies, 1.0, 2.0);
+        checkSteadyState("k-d tree + interaction cache", sim);
+        assert(sim.listCacheStats().reused > 0);
+    }
+    {
+        ds::GeneratorConfig lattice = cfg;
+        lattice.dist = ds::Distribution::LATTICE;
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(1);
+        sim.setTimeStep(1e-4);
+        sim.setCutoff(5.0, 1.0);
+        sim.setSolver(ds::SolverType::CELL_LIST);
+        sim.initFromParticles(ds::generateParticles(lattice, 1), -1.0, 6.0);
+        checkSteadyState("cell list", sim);
+    }
+    cout << "PASSED" << endl;
+}
+
+int main() {
+    cout << "Starting allocation checks..." << endl << endl;
+    try {
+        testContainers();
+        testSteadyStep();
+    } catch (const exception& e) {
+        cerr << "Test FAILED with exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << endl << "All allocation checks passed!" << endl;
+    return 0;
+}
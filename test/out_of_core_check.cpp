@@ -0,0 +1,175 @@
+// Out-of-core stepping: the external Morton sort over several runs must keep every
+// body and order them, a step must match a direct sum followed by the same Euler
+// update as Simulation::step, and a file shorter than its header count is refused.
+//   g++ -std=c++17 -O2 -pthread out_of_core_check.cpp -o out_of_core_check
+#include <iostream>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <tuple>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+
+#include "../out_of_core.hpp"
+
+using namespace std;
+
+constexpr size_t BODIES = 6000;
+constexpr double K = 1.0;
+constexpr double POWER = 2.0;
+constexpr double DT = 1e-3;
+
+auto fields(const ds::BodyRecord& r) { return make_tuple(r.x, r.y, r.m, r.vx, r.vy); }
+
+ds::OutOfCoreConfig smallConfig() {
+    ds::OutOfCoreConfig cfg;
+    cfg.k = K;
+    cfg.power = POWER;
+    cfg.timeStep = DT;
+    cfg.theta = 0.3;
+    cfg.leafSize = 256;
+    cfg.blockLeaves = 4;
+    // about 1024 records per run, so the sort merges several runs
+    cfg.sortMemory = 1024 * sizeof(pair<uint64_t, ds::BodyRecord>);
+    cfg.resortEvery = 1;
+    cfg.threads = 2;
+    return cfg;
+}
+
+void testSortedPermutation(const string& input, const string& work) {
+    cout << "[Running external sort test]..." << endl;
+
+    vector<ds::BodyRecord> in = ds::readBinaryBodies(input);
+    ds::OutOfCoreSimulation sim(smallConfig());
+    sim.init(input, work);
+    assert(sim.size() == in.size());
+    vector<ds::BodyRecord> out = ds::readBinaryBodies(sim.stateFile());
+    assert(out.size() == in.size());
+
+    // the same bodies, in Morton order over their bounding box
+    double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+    for (const auto& r : in) {
+        minX = min(minX, r.x); maxX = max(maxX, r.x);
+        minY = min(minY, r.y); maxY = max(maxY, r.y);
+    }
+    double scale = 4294967295.0 / max(max(maxX - minX, maxY - minY), ds::SOFTENING);
+    auto key = [&](const ds::BodyRecord& r) {
+        return ds::mortonCode((uint32_t)min((r.x - minX) * scale, 4294967295.0),
+                              (uint32_t)min((r.y - minY) * scale, 4294967295.0));
+    };
+    for (size_t i = 1; i < out.size(); ++i) assert(key(out[i - 1]) <= key(out[i]));
+
+    auto byFields = [](const ds::BodyRecord& a, const ds::BodyRecord& b) { return fields(a) < fields(b); };
+    sort(in.begin(), in.end(), byFields);
+    sort(out.begin(), out.end(), byFields);
+    for (size_t i = 0; i < in.size(); ++i) assert(fields(in[i]) == fields(out[i]));
+
+    cout << "PASSED" << endl;
+}
+
+void testStepAgainstDirectSum(const string& input, const string& work) {
+    cout << "[Running step vs direct sum test]..." << endl;
+
+    ds::OutOfCoreSimulation sim(smallConfig());
+    sim.init(input, work);
+    vector<ds::BodyRecord> before = ds::readBinaryBodies(sim.stateFile());
+    sim.step();
+    vector<ds::BodyRecord> after = ds::readBinaryBodies(sim.stateFile());
+    assert(after.size() == before.size());
+    assert(sim.lastStats().blocks == (BODIES + 4 * 256 - 1) / (4 * 256));
+    assert(sim.lastStats().meanFarNodes > 0);
+
+    // records stay in place within a step: acceleration from the velocity change
+    vector<double> err(before.size());
+    for (size_t i = 0; i < before.size(); ++i) {
+        ds::Vec2D<double> f(0.0, 0.0);
+        for (size_t j = 0; j < before.size(); ++j) {
+            if (j == i) continue;
+            ds::Vec2D<double> d(before[j].x - before[i].x, before[j].y - before[i].y);
+            double dist = max(d.mag(), ds::SOFTENING);
+            f += d * (K * before[i].m * before[j].m / pow(dist, POWER) / dist);
+        }
+        ds::Vec2D<double> exact = f / before[i].m;
+        ds::Vec2D<double> got((after[i].vx - before[i].vx) / DT, (after[i].vy - before[i].vy) / DT);
+        err[i] = (got - exact).mag() / max(exact.mag(), 1e-300);
+        // positions take the same Euler update as Simulation::step
+        assert(abs(after[i].x - (before[i].x + after[i].vx * DT)) <= 1e-12 * max(1.0, abs(after[i].x)));
+        assert(abs(after[i].y - (before[i].y + after[i].vy * DT)) <= 1e-12 * max(1.0, abs(after[i].y)));
+        assert(after[i].m == before[i].m);
+    }
+    sort(err.begin(), err.end());
+    double p50 = err[err.size() / 2], p99 = err[err.size() * 99 / 100];
+    cout << "  relative force error p50 " << p50 << ", p99 " << p99 << endl;
+    assert(p50 < 5e-3);
+    assert(p99 < 5e-2);
+
+    // more steps re-sort first (resortEvery 1) and reuse the one prefetch thread
+    for (int i = 0; i < 3; ++i) sim.step();
+    assert(sim.stepsTaken() == 4);
+    vector<ds::BodyRecord> later = ds::readBinaryBodies(sim.stateFile());
+    assert(later.size() == before.size());
+    double m0 = 0, m1 = 0;
+    for (const auto& r : before) m0 += r.m;
+    for (const auto& r : later) m1 += r.m;
+    assert(abs(m1 - m0) <= 1e-9 * m0);
+
+    cout << "PASSED" << endl;
+}
+
+// a header count beyond the file must be refused before anything is sized by it
+void testTruncatedInput(const string& work) {
+    cout << "[Running truncated input test]..." << endl;
+
+    string bad = work + ".truncated.bin";
+    {
+        ofstream f(bad, ios::binary);
+        uint64_t n = uint64_t(1) << 50;
+        ds::BodyRecord r{0, 0, 1, 0, 0};
+        f.write(ds::BINARY_MAGIC, 4);
+        f.write((const char*)&n, sizeof(n));
+        f.write((const char*)&r, sizeof(r));
+    }
+    auto truncated = [](const runtime_error& e) {
+        return string(e.what()).find("Truncated binary body file") == 0;
+    };
+    bool threw = false;
+    try { ds::readBinaryBodies(bad); } catch (const runtime_error& e) { threw = truncated(e); }
+    assert(threw);
+    threw = false;
+    try {
+        ds::OutOfCoreSimulation sim(smallConfig());
+        sim.init(bad, work + ".truncated");
+    } catch (const runtime_error& e) { threw = truncated(e); }
+    assert(threw);
+    remove(bad.c_str());
+
+    cout << "PASSED" << endl;
+}
+
+int main() {
+    cout << "Starting out-of-core checks..." << endl << endl;
+
+    string dir = filesystem::temp_directory_path().string();
+    string input = dir + "/ooc_check_input.bin";
+    string work = dir + "/ooc_check_work";
+    ds::GeneratorConfig gen;
+    gen.dist = ds::Distribution::CLUSTERS;
+    gen.n = BODIES;
+    gen.seed = 11;
+    try {
+        ds::writeBodies(gen, input, 1);
+        testSortedPermutation(input, work);
+        testStepAgainstDirectSum(input, work);
+        testTruncatedInput(work);
+    } catch (const exception& e) {
+        cerr << "Test FAILED with exception: " << e.what() << endl;
+        return 1;
+    }
+    for (const string& f : {input, work + ".a.bin", work + ".b.bin"}) remove(f.c_str());
+
+    cout << endl << "All out-of-core checks passed!" << endl;
+    return 0;
+}
@@ -3,8 +3,11 @@
 #include <cmath>
 #include <vector>
 #include <string>
+#include <map>
+#include <algorithm>
 
 #include "../ds.hpp"
+#include "../simulation.hpp"
 
 using namespace std;
 using namespace ds;
@@ -180,6 +183,408 @@ void testAllocator() {
     cout << "PASSED" << endl;
 }
 
+// A parallel loop inside a batch task (on a worker or on the calling thread) must
+// fall back to plain threads rather than re-enter the pool
+void testNestedParallelFor() {
+    cout << "[Running Nested parallel_for Test]..." << endl;
+
+    vector<int> hits(64, 0);
+    parallel_for(4, 4, [&](size_t b, size_t e, unsigned) {
+        for (size_t i = b; i < e; ++i) {
+            parallel_for(16, 2, [&](size_t bb, size_t ee, unsigned) {
+                for (size_t j = bb; j < ee; ++j) ++hits[i * 16 + j];
+            }, 1);
+        }
+    }, 1);
+    for (int h : hits) assert(h == 1);
+    assert(!insidePool()); // cleared once the batch returns
+
+    cout << "PASSED" << endl;
+}
+
+ParticleVector seededBodies(size_t n, uint64_t seed, Distribution dist = Distribution::UNIFORM) {
+    GeneratorConfig cfg;
+    cfg.dist = dist;
+    cfg.n = n;
+    cfg.seed = seed;
+    return generateParticles(cfg, 1);
+}
+
+BoundingBox boxAround(const ParticleVector& ps) {
+    double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+    for (const auto& p : ps) {
+        minX = min(minX, p.pos.x); maxX = max(maxX, p.pos.x);
+        minY = min(minY, p.pos.y); maxY = max(maxY, p.pos.y);
+    }
+    return {Vec2D<double>((minX + maxX) * 0.5, (minY + maxY) * 0.5), max(maxX - minX, maxY - minY) * 0.6};
+}
+
+void testHashTable() {
+    cout << "[Running HashTable Test]..." << endl;
+
+    // 16 slots: keys whose home is one of the last two fill slots 14, 15, 0, 1, so the
+    // probe runs wrap around the end of the table
+    HashTable<size_t, int> h(8);
+    vector<size_t> keys;
+    for (size_t k = 0; keys.size() < 4; ++k) {
+        if ((splitmix64(k) & 15) >= 14) keys.push_back(k);
+    }
+    for (size_t i = 0; i < keys.size(); ++i) h.insert(keys[i], (int)i);
+    assert(h.size() == 4);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(h.erase(keys[i]));
+        assert(h.find(keys[i]) == nullptr);
+        assert(!h.erase(keys[i]));
+        // the entries behind the hole, past the wrap, must still be found
+        for (size_t j = i + 1; j < keys.size(); ++j) assert(h.search(keys[j]) == (int)j);
+        assert(h.size() == keys.size() - i - 1);
+    }
+    // erasing in the middle of a wrapped run
+    for (size_t i = 0; i < keys.size(); ++i) h.insert(keys[i], (int)i);
+    assert(h.erase(keys[1]) && h.erase(keys[2]));
+    assert(h.search(keys[0]) == 0 && h.search(keys[3]) == 3);
+    assert(h.find(keys[1]) == nullptr && h.find(keys[2]) == nullptr);
+
+    // size across several rehashes, overwrites and erasures
+    HashTable<size_t, size_t> big(4);
+    for (size_t k = 0; k < 5000; ++k) big.insert(k * 7919, k);
+    assert(big.size() == 5000);
+    for (size_t k = 0; k < 5000; k += 2) big.insert(k * 7919, k + 1);
+    assert(big.size() == 5000);
+    for (size_t k = 0; k < 5000; ++k) assert(big.search(k * 7919) == k + (k % 2 == 0));
+    for (size_t k = 1; k < 5000; k += 2) assert(big.erase(k * 7919));
+    assert(big.size() == 2500);
+    for (size_t k = 0; k < 5000; ++k) assert((big.find(k * 7919) != nullptr) == (k % 2 == 0));
+    big.clear();
+    assert(big.size() == 0 && big.find(0) == nullptr);
+
+    cout << "PASSED" << endl;
+}
+
+// Field of a tree at a few probe points, which are not bodies of either tree
+vector<Vec2D<double>> probeField(BarnesHutTree& tree, const BoundingBox& box) {
+    vector<Vec2D<double>> f;
+    for (int i = 0; i < 25; ++i) {
+        Particle probe;
+        probe.pos = box.center + Vec2D<double>((i % 5 - 2) * 0.37, (i / 5 - 2) * 0.41) * box.halfDim;
+        f.push_back(tree.getForceOn(&probe, 1.0, 2.0));
+    }
+    return f;
+}
+
+void testIncrementalTree() {
+    cout << "[Running incremental BarnesHutTree Test]..." << endl;
+    ParticleVector base = seededBodies(400, 21), extra = seededBodies(100, 22), moved(20);
+    ParticleVector all = base;
+    all.insert(all.end(), extra.begin(), extra.end());
+    BoundingBox box = boxAround(all);
+
+    BarnesHutTree tree(2000, 0.5);
+    tree.build(base, box);
+    for (auto& p : extra) assert(tree.insert(&p));
+    // the first 30 leave again, the next 20 are copied to new slots
+    for (size_t i = 0; i < 30; ++i) assert(tree.remove(&extra[i]));
+    assert(!tree.remove(&extra[0]));
+    for (size_t i = 0; i < moved.size(); ++i) {
+        moved[i] = extra[30 + i];
+        assert(tree.relocate(&extra[30 + i], &moved[i]));
+    }
+    // the tree must not read the removed bodies or the old slots any more
+    for (size_t i = 0; i < 50; ++i) extra[i].mass = 0;
+
+    ParticleVector kept = base;
+    kept.insert(kept.end(), extra.begin() + 50, extra.end());
+    kept.insert(kept.end(), moved.begin(), moved.end());
+    BarnesHutTree rebuilt(2000, 0.5);
+    rebuilt.build(kept, box);
+
+    vector<Vec2D<double>> a = probeField(tree, box), b = probeField(rebuilt, box);
+    for (size_t i = 0; i < a.size(); ++i) assert((a[i] - b[i]).mag() <= 1e-9 * b[i].mag());
+    // the relocated bodies are found at their new address
+    for (auto& p : moved) assert(tree.remove(&p));
+
+    cout << "PASSED" << endl;
+}
+
+void testIdStability() {
+    cout << "[Running Simulation id registry Test]..." << endl;
+    ParticleVector bodies = seededBodies(200, 23);
+    bodies[7].isStatic = true;
+    bodies[150].isStatic = true;
+    Simulation sim;
+    sim.setVerbose(false);
+    sim.setThreads(1);
+    sim.initFromParticles(bodies, 1.0, 2.0);
+
+    auto matches = [&](size_t id, const Particle& original) {
+        const Particle* p = sim.findParticle(id);
+        return p && p->id == id && p->pos.x == original.pos.x && p->pos.y == original.pos.y;
+    };
+    for (const auto& p : bodies) assert(matches(p.id, p));
+
+    // removals move the last body into each hole, moving and static ones alike
+    vector<size_t> gone = {0, 7, 42, 150, 198, 199, 5000};
+    assert(sim.removeParticles(gone) == 6);
+    assert(sim.size() == 194);
+    for (const auto& p : bodies) {
+        bool removed = find(gone.begin(), gone.end(), p.id) != gone.end();
+        assert(removed ? sim.findParticle(p.id) == nullptr : matches(p.id, p));
+    }
+
+    // a batch much larger than the store reallocates it, every entry must follow
+    const Particle* store = sim.getParticles().data();
+    ParticleVector batch = seededBodies(1000, 24);
+    size_t first = sim.addParticles(batch);
+    assert(sim.getParticles().data() != store);
+    assert(first == 200);
+    for (size_t i = 0; i < batch.size(); ++i) assert(matches(first + i, batch[i]));
+    for (const auto& p : bodies) {
+        bool removed = find(gone.begin(), gone.end(), p.id) != gone.end();
+        assert(removed ? sim.findParticle(p.id) == nullptr : matches(p.id, p));
+    }
+
+    // and a step keeps every id on its body
+    sim.step();
+    for (const auto& p : sim.getParticles()) assert(sim.findParticle(p.id) == &p);
+
+    cout << "PASSED" << endl;
+}
+
+// One body leaving a uniform square at speed 50: once beyond ESCAPE_FACTOR core
+// half-widths it must be counted as an escaper and kept out of the tree's box
+void testRecedingEscaper() {
+    cout << "[Running receding escaper Test]..." << endl;
+    ParticleVector ps = seededBodies(2000, 41);
+    BoundingBox box = boxAround(ps);
+    for (auto& p : ps) {
+        p.pos = (p.pos - box.center) * (1.0 / box.halfDim);   // about [-0.83, 0.83]^2
+        p.vel = {0.0, 0.0};
+    }
+    ps[0].pos = {0.5, 0.0};
+    ps[0].vel = {50.0, 0.0};
+    Simulation sim;
+    sim.setVerbose(false);
+    sim.setThreads(1);
+    sim.setTimeStep(0.01);
+    // no coupling: the square stays put, so only the box can change the depth
+    sim.initFromParticles(ps, 0.0, 2.0);
+
+    sim.step();
+    int depth = sim.getTree()->depth();
+    for (int i = 1; i <= 400; ++i) {
+        sim.step();
+        double x = sim.findParticle(0)->pos.x;
+        if (x > 5.0) assert(sim.escaperCount() == 1);
+        // 10 for the square, 12 while the body is still inside; 17 to 21 when the box followed it
+        assert(sim.getTree()->depth() <= depth + 2);
+    }
+    assert(sim.findParticle(0)->pos.x > 150.0);
+
+    cout << "PASSED" << endl;
+}
+
+// Bodies of a seeded clustered set, with six escapers outside the box the trees are
+// built over, two of them close together
+ParticleVector queryBodies(BoundingBox& box) {
+    ParticleVector ps = seededBodies(600, 31, Distribution::CLUSTERS);
+    box = boxAround(ps);
+    double h = box.halfDim;
+    for (size_t i = 0; i < 5; ++i) ps[i].pos = box.center + Vec2D<double>(2.0 * h + i * 0.4 * h, 0.5 * h);
+    ps[5].pos = ps[0].pos + Vec2D<double>(0.01 * h, -0.005 * h);
+    return ps;
+}
+
+template<typename Pred>
+vector<Particle*> bruteSelect(ParticleVector& ps, Pred keep) {
+    vector<Particle*> out;
+    for (auto& p : ps) if (keep(p)) out.push_back(&p);
+    sort(out.begin(), out.end());
+    return out;
+}
+
+vector<pair<Particle*, Particle*>> brutePairs(ParticleVector& ps, double r) {
+    vector<pair<Particle*, Particle*>> out;
+    for (size_t i = 0; i < ps.size(); ++i) {
+        for (size_t j = i + 1; j < ps.size(); ++j) {
+            if ((ps[i].pos - ps[j].pos).magSq() <= r * r) out.push_back({&ps[i], &ps[j]});
+        }
+    }
+    sort(out.begin(), out.end());
+    return out;
+}
+
+template<class Tree>
+void checkClosePairs(Tree& tree, ParticleVector& ps, double r) {
+    vector<pair<Particle*, Particle*>> expected = brutePairs(ps, r), got;
+    for (unsigned threads : {1u, 3u}) {
+        tree.closePairs(r, got, threads);
+        sort(got.begin(), got.end());
+        assert(got == expected);
+    }
+}
+
+void testSpatialQueries() {
+    cout << "[Running spatial query Test]..." << endl;
+    BoundingBox box;
+    ParticleVector ps = queryBodies(box);
+    double h = box.halfDim;
+    BarnesHutTree tree(ps.size() * 2, 0.5);
+    tree.build(ps, box);
+    assert(tree.outlierCount() == 6);
+
+    vector<Particle*> got;
+    for (BoundingBox q : {BoundingBox{box.center, 0.3 * h}, BoundingBox{box.center + Vec2D<double>(0.5 * h, -0.2 * h), 0.25 * h},
+                          BoundingBox{ps[0].pos, 0.5 * h}, BoundingBox{box.center, 10 * h}}) {
+        tree.queryRange(q, got);
+        sort(got.begin(), got.end());
+        assert(got == bruteSelect(ps, [&](const Particle& p) { return q.contains(p.pos); }));
+    }
+    assert(got.size() == ps.size());
+
+    vector<Vec2D<double>> centers = {box.center, ps[0].pos, ps[100].pos, box.center + Vec2D<double>(5 * h, 5 * h)};
+    for (const auto& c : centers) {
+        for (double r : {0.0, 0.05 * h, 0.6 * h, 20 * h}) {
+            tree.queryRadius(c, r, got);
+            sort(got.begin(), got.end());
+            assert(got == bruteSelect(ps, [&](const Particle& p) { return (p.pos - c).magSq() <= r * r; }));
+        }
+    }
+
+    // nearest, also for more bodies than there are and with the probe body excluded
+    vector<pair<double, Particle*>> near;
+    for (const auto& c : centers) {
+        for (size_t k : {(size_t)1, (size_t)7, (size_t)50, ps.size() + 10}) {
+            for (const Particle* exclude : {(const Particle*)nullptr, (const Particle*)&ps[0], (const Particle*)&ps[100]}) {
+                vector<double> d2;
+                for (const auto& p : ps) if (&p != exclude) d2.push_back((p.pos - c).magSq());
+                sort(d2.begin(), d2.end());
+                tree.nearest(c, k, near, exclude);
+                assert(near.size() == min(k, d2.size()));
+                for (size_t i = 0; i < near.size(); ++i) {
+                    assert(near[i].first == d2[i]);
+                    assert(near[i].second != exclude && (near[i].second->pos - c).magSq() == near[i].first);
+                }
+            }
+        }
+    }
+    tree.nearest(box.center, 0, near);
+    assert(near.empty());
+
+    // close pairs from both trees, the escaper pair included
+    double r = 0.02 * h;
+    assert(brutePairs(ps, r).size() > 1);
+    checkClosePairs(tree, ps, r);
+    KdTree kd(0.5);
+    kd.build(ps, box);
+    assert(kd.outlierCount() == 6);
+    checkClosePairs(kd, ps, r);
+
+    cout << "PASSED" << endl;
+}
+
+// mergeCaptured against a greedy merge of the brute-force pair list: closest pairs
+// first, the heavier body absorbs the lighter, an absorbed body takes no further part
+void testMergeCaptured() {
+    cout << "[Running Simulation::mergeCaptured Test]..." << endl;
+    BoundingBox box;
+    ParticleVector ps = queryBodies(box);
+    double r = 0.02 * box.halfDim;
+    for (size_t i = 0; i < ps.size(); ++i) ps[i].mass = 1.0 + 0.001 * i;
+    // a chain: 21 absorbs 20, then, heavier now, also 22 in the same sweep
+    ps[21].pos = ps[20].pos + Vec2D<double>(0.2 * r, 0);
+    ps[22].pos = ps[20].pos + Vec2D<double>(-0.6 * r, 0);
+
+    map<size_t, double> mass;
+    for (const auto& p : ps) mass[p.id] = p.mass;
+    vector<pair<double, pair<size_t, size_t>>> pairs;
+    for (size_t i = 0; i < ps.size(); ++i) {
+        for (size_t j = i + 1; j < ps.size(); ++j) {
+            double d2 = (ps[i].pos - ps[j].pos).magSq();
+            if (d2 <= r * r) pairs.push_back({d2, {ps[i].id, ps[j].id}});
+        }
+    }
+    sort(pairs.begin(), pairs.end());
+    size_t merges = 0;
+    for (const auto& pr : pairs) {
+        size_t a = pr.second.first, b = pr.second.second;
+        if (!mass.count(a) || !mass.count(b)) continue;
+        if (mass[b] > mass[a]) swap(a, b);
+        mass[a] = mass[a] + mass[b];
+        mass.erase(b);
+        ++merges;
+    }
+    assert(merges > 2);
+    assert(mass.count(ps[21].id) && !mass.count(ps[20].id) && !mass.count(ps[22].id));
+
+    for (TreeType type : {TreeType::QUADTREE, TreeType::KD_TREE}) {
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(2);
+        sim.setTreeType(type);
+        sim.setCaptureRadius(r);
+        sim.setTimeStep(1e-6);
+        sim.initFromParticles(ps, 1.0, 2.0);
+        sim.step();
+        assert(sim.mergerCount() == merges);
+        assert(sim.size() == mass.size());
+        for (const auto& p : ps) {
+            const Particle* q = sim.findParticle(p.id);
+            assert(mass.count(p.id) ? q && q->mass == mass[p.id] : q == nullptr);
+        }
+    }
+
+    // the sweep does not see pairs across a periodic wrap, so the two refuse each other
+    {
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setCaptureRadius(r);
+        bool threw = false;
+        try { sim.enablePeriodic(4.0); } catch (const invalid_argument&) { threw = true; }
+        assert(threw);
+        sim.setCaptureRadius(0);
+        sim.enablePeriodic(4.0);
+        threw = false;
+        try { sim.setCaptureRadius(r); } catch (const invalid_argument&) { threw = true; }
+        assert(threw);
+    }
+
+    cout << "PASSED" << endl;
+}
+
+// Static bodies leave the particle array but must still show up in rendered frames
+void testRenderStatics() {
+    cout << "[Running Render Statics Test]..." << endl;
+
+    ParticleVector ps = seededBodies(200, 7);
+    for (auto& p : ps) p.pos = p.pos * 0.1; // bulk near the center
+    Particle anchor;
+    anchor.pos = {0.9, 0.9}; // alone in the top-right pixel
+    anchor.mass = 1.0;
+    anchor.isStatic = true;
+    ps.push_back(anchor);
+
+    string base = (filesystem::temp_directory_path() / "sanity_render").string();
+    {
+        Simulation sim;
+        sim.setVerbose(false);
+        sim.setThreads(2);
+        sim.initFromParticles(ps, 0.0, 2.0);
+        assert(sim.getStaticBodies().size() == 1);
+        sim.setRenderer(base + ".raw", 8, 8, RasterFormat::RAW);
+        sim.setRenderView({Vec2D<double>(0.0, 0.0), 1.0});
+        sim.run(1, base + ".txt");
+    }
+    ifstream in(base + ".raw", ios::binary);
+    vector<unsigned char> frame(64);
+    in.read((char*)frame.data(), frame.size());
+    assert(in.gcount() == 64);
+    assert(frame[0 * 8 + 7] > 0); // row 0 is the top
+    remove((base + ".raw").c_str());
+    remove((base + ".txt").c_str());
+
+    cout << "PASSED" << endl;
+}
+
 int main() {
     cout << "Starting Unit Tests..." << endl << endl;
 
@@ -189,6 +594,14 @@ int main() {
         testVec2D();
         testPhysicsStructs();
         testAllocator();
+        testNestedParallelFor();
+        testHashTable();
+        testIncrementalTree();
+        testIdStability();
+        testSpatialQueries();
+        testRecedingEscaper();
+        testMergeCaptured();
+        testRenderStatics();
     } catch (const exception& e) {
         cerr << "Test FAILED with exception: " << e.what() << endl;
         return 1;